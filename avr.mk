@@ -68,15 +68,27 @@ STRIP=$(BINDIR)/avr-strip
 LIBRADIO=../lib/libradio.a
 FIRMWARE?=firmware.hex
 
+# Library build options, such as OPTS=-DLIBRADIO_HW_CTS (see README.md)
+OPTS?=
+
 # https://eleccelerator.com/fusecalc/fusecalc.php
+# With LIBRADIO_OTA, BOOTRST is programmed so that a reset goes through
+# the boot section, which finishes an interrupted firmware install.
 LFUSE?=0xef
+ifneq ($(findstring LIBRADIO_OTA,$(OPTS)),)
+HFUSE?=0xde
+else
 HFUSE?=0xdf
+endif
 EFUSE?=0xfc
 
 ASFLAGS= -mmcu=$(DEVICE) -I$(AVR)
-CFLAGS=	-Wall -O2 -mmcu=$(DEVICE) -I$(AVR) -I..
+CFLAGS=	-Wall -O2 -mmcu=$(DEVICE) -I$(AVR) -I.. $(OPTS)
 LDFLAGS=-nostartfiles -u __vectors -mmcu=$(DEVICE) -L$(AVR) -Wl,--section-start=.bstrap0=0x7e00
 LIBS=	-L../lib -lradio -lavr.$(DEVICE)
+ifneq ($(findstring LIBRADIO_OTA,$(OPTS)),)
+LDFLAGS+= ../lib/ota.ld
+endif
 
 all:	$(BIN)
 
@@ -105,7 +117,7 @@ srclist.pdf: srclist.ps
 	ps2pdf srclist.ps srclist.pdf
 
 %.o:	%.S
-	$(CC) -E -mmcu=$(DEVICE) $< > temp.s
+	$(CC) -E -mmcu=$(DEVICE) $(OPTS) $< > temp.s
 	$(AS) $(ASFLAGS) -o $(<:.S=.o) temp.s
 	rm temp.s
 
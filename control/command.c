@@ -108,6 +108,7 @@ mycommand(struct packet *pp)
 		 */
 		if (pp->len != 3)
 			break;
+		clock_sync();
 		radio.ms_ticks = (pp->data[0] << 8 | pp->data[1]);
 		radio.tens_of_minutes = pp->data[2];
 		printf(">> Ctlr Time:%u/%u\n", radio.ms_ticks, radio.tens_of_minutes);
@@ -175,6 +176,7 @@ local_status(uchar_t stype)
 	int i, bv, len = 0;
 	uchar_t status[10];
 
+	clock_sync();
 	switch (stype) {
 	case RADIO_STATUS_DYNAMIC:
 		bv = analog_read(3);
@@ -198,6 +200,15 @@ local_status(uchar_t stype)
 		status[5] = FW_VERSION_L;
 		len = 6;
 		break;
+
+	case RADIO_STATUS_LINK:
+	case RADIO_STATUS_LINK + 1:
+	case RADIO_STATUS_LINK + 2:
+	case RADIO_STATUS_LINK + 3:
+	case RADIO_STATUS_LINK + 4:
+	case RADIO_STATUS_LINK + 5:
+		len = libradio_link_status(stype, status, sizeof(status));
+		break;
 	}
 	printf("<%c%d:%u:%d:%d", radio.my_channel + 'A', radio.my_node_id,
 							radio.ms_ticks, RADIO_STATUS_RESPONSE, stype);
@@ -43,8 +43,20 @@
 #define BATTERY_OK		800
 
 #define MAX_RADIO_CHANNELS	6
+#define TXPOOL_SIZE			4
+
+/*
+ * Reliable delivery (LIBRADIO_RELIABLE). Sequence numbers are kept for
+ * TXSEQ_SLOTS groups of nodes. A packet is sent up to TX_MAX_TRIES
+ * times, and the channel backs off for TX_BACKOFF ms before the first
+ * retry, doubling each time.
+ */
+#define TXSEQ_SLOTS			16
+#define TX_MAX_TRIES		4
+#define TX_BACKOFF			100
 
 extern struct channel		channels[MAX_RADIO_CHANNELS];
+extern struct channel		txpool[TXPOOL_SIZE];
 extern struct channel		*resp_chp;
 
 /*
@@ -54,11 +66,17 @@ void	clock_init();
 void	serial_init();
 void	tx_init();
 void	tx_check_queues();
+struct channel	*tx_alloc();
+void	tx_done(struct channel *, uchar_t);
+void	tx_seq(struct channel *);
+void	tx_ack(struct channel *);
+void	tx_retry(struct channel *);
 void	process_input();
 uchar_t	mycommand(struct packet *);
 void	send_time(struct channel *);
-void	enqueue(struct channel *);
-void	txresponse(struct channel *);
+void	enqueue(uchar_t, struct channel *);
+void	enqueue_frag(uchar_t, struct channel *, uchar_t [], uchar_t);
+uchar_t	txresponse(struct channel *);
 void	set_channel(uchar_t, uchar_t);
 void	local_status(uchar_t);
 void	reply(uchar_t);
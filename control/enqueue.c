@@ -43,15 +43,77 @@
 #include "internal.h"
 #include "control.h"
 
+uchar_t	enqueue_packet(uchar_t, struct channel *);
+
+/*
+ * Queue up a packet and let the upstream system know how it went.
+ */
+void
+enqueue(uchar_t channo, struct channel *chp)
+{
+	reply(enqueue_packet(channo, chp));
+}
+
+#ifdef LIBRADIO_FRAG
+/*
+ * Queue up a command which is too big for one packet, as a series of
+ * fragments. All of the packet buffers are found first, so that either
+ * the whole thing is queued, or none of it. There's no point in sending
+ * fragments to ourselves.
+ */
+void
+enqueue_frag(uchar_t channo, struct channel *chp, uchar_t buffer[], uchar_t len)
+{
+	uchar_t i, n, tag, code = 0;
+	uchar_t node = chp->packet.node, cmd = chp->packet.cmd;
+	struct channel *fchp[FRAG_MAX_FRAGS];
+
+	if (node == radio.my_node_id) {
+		chp->state = LIBRADIO_CHSTATE_EMPTY;
+		reply(RADIO_CTLERR_TOO_BIG);
+		return;
+	}
+	n = libradio_frag_count(len);
+	fchp[0] = chp;
+	for (i = 1; i < n; i++) {
+		if ((fchp[i] = tx_alloc()) == NULL) {
+			while (i-- > 0)
+				fchp[i]->state = LIBRADIO_CHSTATE_EMPTY;
+			reply(RADIO_CTLERR_BUSY);
+			return;
+		}
+	}
+	tag = libradio_frag_tag();
+	for (i = 0; i < n; i++) {
+		fchp[i]->packet.node = node;
+		fchp[i]->packet.cmd = RADIO_CMD_FRAGMENT;
+		fchp[i]->packet.len = libradio_frag_pack(fchp[i]->packet.data, cmd, tag, buffer, len, i);
+		if ((code = enqueue_packet(channo, fchp[i])) != 0) {
+			/*
+			 * Free up the rest.
+			 */
+			while (++i < n)
+				fchp[i]->state = LIBRADIO_CHSTATE_EMPTY;
+			break;
+		}
+	}
+	reply(code);
+}
+#endif
+
 /*
  * Add the packet to the queue. Set the state to TRANSMIT if we're ready to
  * send. Deal with the special-case where this is addressed to us and we
- * don't need to transmit it.
+ * don't need to transmit it. If the packet is in an extra buffer (see
+ * tx_alloc()) then chain it on to the end of the channel. Returns the
+ * code for the reply to the upstream system.
  */
-void
-enqueue(struct channel *chp)
+uchar_t
+enqueue_packet(uchar_t channo, struct channel *chp)
 {
+	uchar_t code;
 	struct packet *pp = &chp->packet;
+	struct channel *hchp = &channels[channo];
 
 	printf("ENQ:S%d,N%d,C%d,M%d\n", radio.state, pp->node, pp->cmd, radio.my_node_id);
 	chp->state = LIBRADIO_CHSTATE_TRANSMIT;
@@ -62,9 +124,9 @@ enqueue(struct channel *chp)
 		 * Instead, execute the command. Also, free up the channel buffer
 		 * if this is the only transmission.
 		 */
-		reply(mycommand(pp));
+		code = mycommand(pp);
 		chp->state = LIBRADIO_CHSTATE_EMPTY;
-		return;
+		return(code);
 	}
 	/*
 	 * Packet is for transmission. Update the channel offset. Note that we
@@ -72,8 +134,7 @@ enqueue(struct channel *chp)
 	 */
 	if (radio.state != LIBRADIO_STATE_ACTIVE) {
 		chp->state = LIBRADIO_CHSTATE_EMPTY;
-		reply(RADIO_CTLERR_NOT_ACTIVE);
-		return;
+		return(RADIO_CTLERR_NOT_ACTIVE);
 	}
 	/*
 	 * Add the node, length and channel to the length. Then update
@@ -83,7 +144,27 @@ enqueue(struct channel *chp)
 		chp->state = LIBRADIO_CHSTATE_TXRESPOND;
 	else
 		chp->state = LIBRADIO_CHSTATE_TRANSMIT;
+	tx_seq(chp);
 	printf("CMD:%d (datalen%d) S%d\n", pp->cmd, chp->packet.len, chp->state);
+	if (chp != hchp) {
+		if (hchp->state == LIBRADIO_CHSTATE_EMPTY) {
+			/*
+			 * The channel emptied out while we were busy
+			 * reading the packet. Move it back in.
+			 */
+			hchp->state = chp->state;
+			hchp->tries = chp->tries;
+			hchp->packet = chp->packet;
+			chp->state = LIBRADIO_CHSTATE_EMPTY;
+		} else {
+			struct channel *tchp;
+
+			for (tchp = hchp; tchp->next != NULL; tchp = tchp->next)
+				;
+			tchp->next = chp;
+		}
+		chp = hchp;
+	}
 	/*
 	 * Calculate the TX priority. This is channel-dependent with
 	 * channel 0 having the highest priority. Multiply this by 8
@@ -100,21 +181,27 @@ enqueue(struct channel *chp)
 		if (chp->priority < 0xfc)
 			chp->priority++;
 	}
-	reply(0);
+	return(0);
 }
 
 /*
  * Set a channel state to one of {DISABLED, READ, EMPTY}. This is the command
- * used to enable or disable a radio channel.
+ * used to enable or disable a radio channel. Any packets still chained on
+ * the channel are dropped, and their buffers go back to the pool.
  */
 void
 set_channel(uchar_t channo, uchar_t config)
 {
-	struct channel *chp;
+	struct channel *chp, *nchp;
 
 	if (channo < 0 || channo >= MAX_RADIO_CHANNELS)
 		return;
 	chp = &channels[channo];
+	while ((nchp = chp->next) != NULL) {
+		chp->next = nchp->next;
+		nchp->state = LIBRADIO_CHSTATE_EMPTY;
+		nchp->next = NULL;
+	}
 	if (config < 3)
 		chp->state = config;
 	chp->priority = 0;
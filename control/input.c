@@ -53,7 +53,12 @@
 
 uchar_t			state = IO_STATE_NEWLINE;
 uchar_t			value;
+uchar_t			curr_channo;
 struct channel	*curr_chp;
+uchar_t			inbuf[LIBRADIO_FRAG_MAX];
+uchar_t			inlen;
+
+void	input_enqueue();
 
 /*
  *
@@ -69,7 +74,14 @@ process_input()
 	 */
 	if (ch == '\n' || ch == '\r') {
 		if (state >= IO_STATE_WAITCMD)
-			enqueue(curr_chp);
+			input_enqueue();
+		else if (curr_chp != NULL && curr_chp->state == LIBRADIO_CHSTATE_ADDING) {
+			/*
+			 * Abandoned half-way through. Free up the buffer.
+			 */
+			curr_chp->state = LIBRADIO_CHSTATE_EMPTY;
+		}
+		curr_chp = NULL;
 		state = IO_STATE_NEWLINE;
 		return;
 	}
@@ -100,7 +112,8 @@ process_input()
 			break;
 		}
 		curr_chp = &channels[value];
-		if (curr_chp->state > LIBRADIO_CHSTATE_EMPTY) {
+		if (curr_chp->state > LIBRADIO_CHSTATE_EMPTY &&
+						(curr_chp = tx_alloc()) == NULL) {
 			/*
 			 * Too much data for this channel. Abort!
 			 */
@@ -108,8 +121,9 @@ process_input()
 			break;
 		}
 		curr_chp->state = LIBRADIO_CHSTATE_ADDING;
+		curr_channo = value;
 		state = IO_STATE_WAITNODE;
-		value = 0;
+		value = inlen = 0;
 		break;
 
 	case STATE(IO_STATE_WAITCHAN, 'R'):
@@ -164,10 +178,10 @@ process_input()
 	case STATE(IO_STATE_WAITCMD, ':'):
 	case STATE(IO_STATE_WAITCMD, '.'):
 		curr_chp->packet.cmd = value;
-		curr_chp->packet.len = 0;
+		curr_chp->packet.len = inlen = 0;
 		value = 0;
 		if (ch == '.') {
-			enqueue(curr_chp);
+			input_enqueue();
 			state = IO_STATE_WAITNL;
 		} else
 			state = IO_STATE_WAITDATA;
@@ -175,18 +189,17 @@ process_input()
 
 	case STATE(IO_STATE_WAITDATA, ','):
 	case STATE(IO_STATE_WAITDATA, '.'):
-		if (curr_chp->packet.len >= MAX_PAYLOAD_SIZE) {
+		if (inlen >= LIBRADIO_FRAG_MAX) {
 			/*
-			 * Too much data for this channel. Abort! Note that we reserve
-			 * two bytes to specify node:0,len:0 at the end.
+			 * Too much data, even for fragments. Abort!
 			 */
 			reply(RADIO_CTLERR_TOO_BIG);
 			break;
 		}
-		curr_chp->packet.data[curr_chp->packet.len++] = value;
+		inbuf[inlen++] = value;
 		value = 0;
 		if (ch == '.') {
-			enqueue(curr_chp);
+			input_enqueue();
 			state = IO_STATE_WAITNL;
 		}
 		break;
@@ -198,6 +211,27 @@ process_input()
 	}
 }
 
+/*
+ * The command has been read in. If the payload fits in a packet, queue
+ * it up as is, otherwise send it in fragments.
+ */
+void
+input_enqueue()
+{
+	uchar_t i;
+
+#ifdef LIBRADIO_FRAG
+	if (inlen > MAX_PAYLOAD_SIZE) {
+		enqueue_frag(curr_channo, curr_chp, inbuf, inlen);
+		return;
+	}
+#endif
+	for (i = 0; i < inlen; i++)
+		curr_chp->packet.data[i] = inbuf[i];
+	curr_chp->packet.len = inlen;
+	enqueue(curr_channo, curr_chp);
+}
+
 /*
  *
  */
@@ -94,18 +94,35 @@ main()
 		libradio_wait();
 		if (resp_chp != NULL) {
 			if (libradio_check_rx()) {
-				txresponse(resp_chp);
-				resp_chp->state = LIBRADIO_CHSTATE_EMPTY;
-				resp_chp = NULL;
+				/*
+				 * A reliable packet (one with tries) is waiting
+				 * for an ACK rather than a response.
+				 */
+				if (resp_chp->tries != 0)
+					tx_ack(resp_chp);
+				else if (txresponse(resp_chp)) {
+					tx_done(resp_chp, 1);
+					resp_chp = NULL;
+				} else {
+					/*
+					 * Part of a response. Give the client
+					 * a bit longer.
+					 */
+					resp_chp->state = LIBRADIO_CHSTATE_RXRESPONSE1;
+				}
 			} else {
 				/*
 				 * Only allow a few passes through here while waiting for a response.
-				 * After that, just give up.
+				 * After that, just give up (or try again).
 				 */
 				if (resp_chp->state == LIBRADIO_CHSTATE_RXRESPONSE4) {
-					printf("Response timeout!\n");
-					resp_chp->state = LIBRADIO_CHSTATE_EMPTY;
-					resp_chp = NULL;
+					if (resp_chp->tries != 0)
+						tx_retry(resp_chp);
+					else {
+						printf("Response timeout!\n");
+						tx_done(resp_chp, 1);
+						resp_chp = NULL;
+					}
 				} else
 					resp_chp->state++;
 			}
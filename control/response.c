@@ -52,9 +52,11 @@
 /*
  * Deal with a status response from a client. We asked for a STATUS update or
  * EEPROM data and now the client has sent us what we wanted. Forward the
- * packet up via the RS232 line and go back to TX mode.
+ * packet up via the RS232 line and go back to TX mode. A big response
+ * comes in fragments, so put it back together first. Returns zero if
+ * we're still waiting for the rest of the response.
  */
-void
+uchar_t
 txresponse(struct channel *chp)
 {
 	int i, len, from_chan = 0, from_node = 0;
@@ -64,14 +66,19 @@ txresponse(struct channel *chp)
 	from_node = chp->packet.node;
 	printf("RCV from %d on ch%d\n", from_node, from_chan);
 	if (libradio_recv(chp, from_chan) == 0)
-		return;
+		return(1);
+#ifdef LIBRADIO_FRAG
+	if (pp->cmd == RADIO_CMD_FRAGMENT && (pp = libradio_frag_rx(pp)) == NULL)
+		return(0);
+#endif
 	printf("<%c%d:%u:%d:", from_chan + 'A', from_node, pp->ticks, pp->cmd);
-	if ((len = pp->len) > MAX_PAYLOAD_SIZE)
-		len = MAX_PAYLOAD_SIZE;
+	if ((len = pp->len) > LIBRADIO_FRAG_MAX)
+		len = LIBRADIO_FRAG_MAX;
 	for (i = 0; i < len; i++) {
 		if (i > 0)
 			putchar(',');
 		printf("%d", pp->data[i]);
 	}
 	putchar('\n');
+	return(1);
 }
@@ -46,8 +46,15 @@
 #define SET_TIME_MODULO		500
 
 struct channel	channels[MAX_RADIO_CHANNELS];
+struct channel	txpool[TXPOOL_SIZE];
 struct channel	*resp_chp;
 struct packet	*pp;
+#ifdef LIBRADIO_RELIABLE
+uchar_t			txseq[TXSEQ_SLOTS];
+unsigned long	tx_hold[MAX_RADIO_CHANNELS];
+#endif
+
+void	tx_report(struct channel *, uchar_t);
 
 /*
  * Initialize operations. We send time stamps on each channel in and around the
@@ -59,23 +66,197 @@ tx_init()
 	int i;
 	struct channel *chp;
 
-	for (i = 0, chp = channels; i < MAX_RADIO_CHANNELS; i++) {
+	for (i = 0, chp = channels; i < MAX_RADIO_CHANNELS; i++, chp++) {
 		chp->state = LIBRADIO_CHSTATE_DISABLED;
-		chp->priority = 0;
+		chp->priority = chp->tries = 0;
+		chp->next = NULL;
+	}
+	for (i = 0, chp = txpool; i < TXPOOL_SIZE; i++, chp++) {
+		chp->state = LIBRADIO_CHSTATE_EMPTY;
+		chp->tries = 0;
+		chp->next = NULL;
+	}
+	resp_chp = NULL;
+#ifdef LIBRADIO_RELIABLE
+	/*
+	 * Don't start the sequence numbers from the same place after every
+	 * reboot. Bringing the radio up takes a variable amount of time, so
+	 * Timer1 is as good a seed as any.
+	 */
+	for (i = 0; i < TXSEQ_SLOTS; i++)
+		txseq[i] = (TCNT1 + i * 37) & RADIO_SEQ_MASK;
+#endif
+}
+
+/*
+ * Allocate an extra packet buffer, for when a channel already has a
+ * packet queued. It will be chained on to the channel by enqueue().
+ */
+struct channel *
+tx_alloc()
+{
+	int i;
+	struct channel *chp;
+
+	for (i = 0, chp = txpool; i < TXPOOL_SIZE; i++, chp++) {
+		if (chp->state == LIBRADIO_CHSTATE_EMPTY) {
+			chp->state = LIBRADIO_CHSTATE_ADDING;
+			chp->priority = 0;
+			chp->next = NULL;
+			return(chp);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Retire the first npackets packets on a channel. Any chained packets
+ * are moved up into the channel itself, and their buffers are freed.
+ */
+void
+tx_done(struct channel *chp, uchar_t npackets)
+{
+	struct channel *nchp;
+
+	while (npackets-- > 0) {
+		if ((nchp = chp->next) == NULL) {
+			chp->state = LIBRADIO_CHSTATE_EMPTY;
+			chp->priority = 0;
+			return;
+		}
+		chp->state = nchp->state;
+		chp->tries = nchp->tries;
+		chp->packet = nchp->packet;
+		chp->next = nchp->next;
+		nchp->state = LIBRADIO_CHSTATE_EMPTY;
+		nchp->next = NULL;
+	}
+	/*
+	 * Still more to send.
+	 */
+	if (chp->priority == 0)
+		chp->priority = (MAX_RADIO_CHANNELS - (chp - channels)) << 3;
+}
+
+/*
+ * Give a unicast packet the next sequence number for its node, so that
+ * the client can spot a duplicate. With LIBRADIO_RELIABLE, a packet
+ * which doesn't already expect a response also asks for an ACK, and is
+ * sent again until it gets one.
+ */
+void
+tx_seq(struct channel *chp)
+{
+#ifdef LIBRADIO_RELIABLE
+	uchar_t *sp;
+	struct packet *pp = &chp->packet;
+
+	chp->tries = pp->seq = 0;
+	if (pp->node == 0)
+		return;
+	sp = &txseq[pp->node % TXSEQ_SLOTS];
+	if ((*sp = (*sp + 1) & RADIO_SEQ_MASK) == 0)
+		*sp = 1;
+	pp->seq = *sp;
+	if (chp->state == LIBRADIO_CHSTATE_TRANSMIT ||
+					chp->state == LIBRADIO_CHSTATE_TXRELIABLE) {
+		pp->seq |= RADIO_SEQ_ACKREQ;
+		chp->state = LIBRADIO_CHSTATE_TXRELIABLE;
+	}
+#else
+	chp->tries = 0;
+#endif
+}
+
+/*
+ * Something arrived while we were waiting for the ACK to a reliable
+ * packet. If it's the right ACK, the packet has been delivered. If
+ * not, ignore it and keep waiting. The client also tells us if it
+ * dropped the packet as a duplicate. That's fine after a retry (our
+ * first ACK went missing), but on the first try it means the client's
+ * last sequence number happened to match ours (we've rebooted, or
+ * another node in the same slot has used up the numbers in between).
+ * The packet hasn't been delivered, so give it a new sequence number
+ * and send it again straight away.
+ */
+void
+tx_ack(struct channel *chp)
+{
+#ifdef LIBRADIO_RELIABLE
+	struct channel ack;
+	struct packet *pp = &ack.packet;
+
+	if (libradio_recv(&ack, chp - channels) == 0)
+		return;
+	if (pp->cmd != RADIO_CMD_ACK || pp->node != chp->packet.node ||
+				pp->len != 2 ||
+				pp->data[0] != (chp->packet.seq & RADIO_SEQ_MASK))
+		return;
+	if (pp->data[1] != 0 && chp->tries == 1) {
+		radio.link[LINK_REL_RETRIES]++;
+		chp->state = LIBRADIO_CHSTATE_TXRELIABLE;
+		tx_seq(chp);
+		chp->priority = (MAX_RADIO_CHANNELS - (chp - channels)) << 3;
+		resp_chp = NULL;
+		return;
 	}
+	radio.link[LINK_REL_DELIVERED]++;
+	tx_report(chp, 1);
+	tx_done(chp, 1);
+	resp_chp = NULL;
+#endif
+}
+
+/*
+ * No ACK for a reliable packet. Hold the channel off for a while and
+ * then send it again, unless we've run out of tries.
+ */
+void
+tx_retry(struct channel *chp)
+{
+#ifdef LIBRADIO_RELIABLE
+	uchar_t channo = chp - channels;
+
 	resp_chp = NULL;
+	if (chp->tries >= TX_MAX_TRIES) {
+		radio.link[LINK_REL_FAILED]++;
+		tx_report(chp, 0);
+		tx_done(chp, 1);
+		return;
+	}
+	chp->state = LIBRADIO_CHSTATE_TXRELIABLE;
+	chp->priority = (MAX_RADIO_CHANNELS - channo) << 3;
+	tx_hold[channo] = libradio_uptime() + ((unsigned long )TX_BACKOFF << (chp->tries - 1));
+#endif
+}
+
+/*
+ * Tell the upstream system whether or not a reliable packet was
+ * delivered, in the form of a RADIO_CMD_ACK response. The data is
+ * a delivery flag, the command and the number of tries.
+ */
+void
+tx_report(struct channel *chp, uchar_t delivered)
+{
+	printf("<%c%d:%u:%d:%d,%d,%d\n", (int )(chp - channels) + 'A',
+					chp->packet.node, radio.ms_ticks, RADIO_CMD_ACK,
+					delivered, chp->packet.cmd, chp->tries);
 }
 
 /*
  * Check to see if we need to send a packet on an active channel. Also, send
- * a time sync on a periodic basis.
+ * a time sync on a periodic basis. Any packets chained on to the channel
+ * are aggregated into the same frame, if they fit.
  */
 void
 tx_check_queues()
 {
-	int channo, modulo;
-	struct channel *chp;
+	int i, n, channo, modulo;
+	struct channel *chp, *lchp;
 	static int last_modulo = 0;
+#ifdef LIBRADIO_RELIABLE
+	unsigned long now = libradio_uptime();
+#endif
 
 	if (radio.state < LIBRADIO_STATE_LISTEN)
 		return;
@@ -83,6 +264,7 @@ tx_check_queues()
 	 * First off, send a time stamp on each of the active channels regardless
 	 * of anything else.
 	 */
+	clock_sync();
 	modulo = radio.ms_ticks % SET_TIME_MODULO;
 	chp = NULL;
 	if (modulo < last_modulo) {
@@ -101,10 +283,14 @@ tx_check_queues()
 			 */
 			chp->state = LIBRADIO_CHSTATE_TRANSMIT;
 			chp->priority = 0xff;
+			chp->tries = 0;
 			pp = &chp->packet;
 			pp->node = 0;
 			pp->len = 1;
 			pp->cmd = RADIO_CMD_SET_TIME;
+#ifdef LIBRADIO_RELIABLE
+			pp->seq = 0;
+#endif
 			pp->data[0] = radio.tens_of_minutes;
 		}
 	}
@@ -121,6 +307,13 @@ tx_check_queues()
 								channo++, chp++) {
 			if (chp->priority == 0 || chp->state < LIBRADIO_CHSTATE_TRANSMIT)
 				continue;
+#ifdef LIBRADIO_RELIABLE
+			/*
+			 * Still backing off before a retry?
+			 */
+			if (chp->tries != 0 && (long )(now - tx_hold[channo]) < 0)
+				continue;
+#endif
 			if (nchp == NULL || chp->priority > nchp->priority)
 				nchp = chp;
 		}
@@ -133,21 +326,29 @@ tx_check_queues()
 	 */
 	channo = chp - channels;
 	printf("TX%d:chst:%d,C%d,len%d\n", channo, chp->state, chp->packet.cmd, chp->packet.len);
-	if (libradio_send(chp, channo) != 0) {
-		if (chp->state == LIBRADIO_CHSTATE_TXRESPOND) {
+	if ((n = libradio_send(chp, channo)) != 0) {
+		for (lchp = chp, i = 1; i < n; i++)
+			lchp = lchp->next;
+		chp->priority = 0;
+		if (lchp->state == LIBRADIO_CHSTATE_TXRESPOND ||
+						lchp->state == LIBRADIO_CHSTATE_TXRELIABLE) {
 			/*
 			 * Once transmission has ended, the radio will
 			 * immediately go to RX mode. Enable the IRQ
-			 * and wait for the response. Save the channel
-			 * pointer so the main code knows not to send
-			 * a transmission until we've received the reply.
+			 * and wait for the response (or ACK). Save the
+			 * channel pointer so the main code knows not to
+			 * send a transmission until we've received the
+			 * reply. The packet which wanted the response is
+			 * moved up to the front of the channel.
 			 */
+			tx_done(chp, n - 1);
+			if (chp->state == LIBRADIO_CHSTATE_TXRELIABLE && chp->tries++ > 0)
+				radio.link[LINK_REL_RETRIES]++;
 			libradio_irq_enable(1);
 			chp->state = LIBRADIO_CHSTATE_RXRESPONSE1;
 			resp_chp = chp;
 		} else
-			chp->state = LIBRADIO_CHSTATE_EMPTY;
-		chp->priority = 0;
+			tx_done(chp, n);
 	}
 	/*
 	 * Now increment the priority of the remaining channels to prevent them
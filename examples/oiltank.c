@@ -60,6 +60,7 @@
 
 void	get_battery_voltage();
 void	get_oil_level();
+void	readings(uchar_t);
 
 uchar_t		mynum1;
 uchar_t		mynum2;
@@ -72,8 +73,6 @@ int			oil_level;
 int
 main()
 {
-	int tlsecs;
-
 	_setled(1);
 	cli();
 	/*
@@ -119,25 +118,30 @@ main()
 	libradio_recv_start();
 	libradio_irq_enable(1);
 	/*
-	 * Begin the main loop - every clock tick, call the radio loop.
+	 * Set up the event handlers. The radio comes first, then our own
+	 * readings. Post the readings handler so it runs straight away.
 	 */
-	tlsecs = 0;
-	get_battery_voltage();
-	get_oil_level();
-	while (1) {
-		/*
-		 * Call the libradio function to see if there's anything to do. This
-		 * routine only returns after a sleep or if the main clock has ticked.
-		 */
-		libradio_rxloop();
-		/*
-		 * Every five minutes, check the battery and the oil level.
-		 */
-		if (libradio_elapsed_second() && ++tlsecs >= 300) {
-			get_battery_voltage();
-			get_oil_level();
-			tlsecs = 0;
-		}
+	libradio_event_add(0, LIBRADIO_WAIT_ALL, libradio_rxevent);
+	libradio_event_add(1, LIBRADIO_WAIT_DEADLINE, readings);
+	libradio_event_post(1);
+	/*
+	 * Begin the main loop. Each pass sleeps until there's something
+	 * to do, and then calls the handlers.
+	 */
+	while (1)
+		libradio_event_run();
+}
+
+/*
+ * Every five minutes, check the battery and the oil level.
+ */
+void
+readings(uchar_t status)
+{
+	if ((status & LIBRADIO_WAIT_POSTED) || libradio_timer_expired(LIBRADIO_TIMER_USER)) {
+		get_battery_voltage();
+		get_oil_level();
+		libradio_timer_arm(LIBRADIO_TIMER_USER, 300000L);
 	}
 }
 
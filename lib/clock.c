@@ -35,6 +35,22 @@
  * intertwined with the real-time clock interrupts, the actual ISR is
  * part of this library rather than the application. It also manages to
  * flash the main LED with the appropriate indication of current state.
+ *
+ * With LIBRADIO_TICKLESS, Timer1 doesn't interrupt on every tick. The
+ * compare register is pushed out to the next tick on which something
+ * actually happens (main_ticks expiring, an LED change, a wake-up
+ * requested by the library) and the ticks in between are counted in
+ * one go, either by the interrupt or on demand (see clock_sync()) from
+ * TCNT1. The tick length is whatever the application programmed into
+ * OCR1A, and a period can't be longer than the 16-bit counter allows
+ * (26 ticks with the usual OCR1A of 2499).
+ *
+ * The uptime is a 32-bit count of milliseconds since boot. It isn't
+ * slewed or set, so it only ever goes forward (at whatever rate the
+ * clock is ticking), which makes it the right thing for timeouts. On
+ * top of it are a handful of deadline timers. Arm one for so many ms
+ * from now and libradio_wait() will return LIBRADIO_WAIT_DEADLINE once
+ * it expires. Then libradio_timer_expired() says which.
  */
 #include <stdio.h>
 #include <avr/io.h>
@@ -53,9 +69,70 @@ uchar_t		hbclock = 0;
 uint_t		timer_count;
 uchar_t		thread_ok;
 uchar_t		elapsed_second;
+#ifdef LIBRADIO_DRIFT
+long		slew_acc;
+long		slew_steps;
+#endif
+
+/*
+ * Deadline timers. The expiry time (in uptime ms) of each, a bitmask of
+ * those armed and another of those which have expired. timer_next is
+ * the earliest armed expiry, so the ISR has only the one comparison.
+ */
+unsigned long	timer_when[LIBRADIO_NTIMERS];
+unsigned long	timer_next;
+uchar_t		timer_armed;
+uchar_t		timer_due;
+volatile uchar_t	timer_fired;
+
+#ifdef LIBRADIO_TICKLESS
+/*
+ * Timer1 counts per tick, the number of ticks in the current Timer1
+ * period and how many of those have been counted already. The LED state
+ * and any wake-up time (in all_ticks) requested via clock_wake().
+ */
+uint_t		tick_counts;
+uchar_t		tick_run;
+uchar_t		tick_done;
+uchar_t		ledon;
+uchar_t		wake_set;
+uint_t		wake_at;
+
+uchar_t	clock_next();
+#endif
+
+void	clock_step();
+void	timer_scan();
+
+/*
+ * Called from the Timer1 compare interrupt. Normally this is every
+ * clock tick. In tickless mode, count the ticks in the period just gone
+ * (that haven't already been counted) and work out when the next one
+ * will be needed.
+ */
+void
+clocktick()
+{
+#ifdef LIBRADIO_TICKLESS
+	if (tick_counts == 0) {
+		tick_counts = OCR1A + 1;
+		tick_run = 1;
+	}
+	while (tick_done < tick_run) {
+		clock_step();
+		tick_done++;
+	}
+	tick_done = 0;
+	tick_run = clock_next();
+	OCR1A = (uint_t )tick_run * tick_counts - 1;
+#else
+	clock_step();
+#endif
+	pkt_tick();
+}
 
 /*
- * This function is called every clock tick (every 10ms) or one hundred
+ * This function is called for every clock tick (every 10ms) or one hundred
  * times per second. Increment the millisecond clock, and if we've passed the
  * tens of minutes, then increment that. The ToM parks itself at 255 which is
  * an illegal value used at init, to let us know we don't actually know what
@@ -64,9 +141,9 @@ uchar_t		elapsed_second;
  * loop doesn't run too quickly.
  */
 void
-clocktick()
+clock_step()
 {
-	uchar_t ledf;
+	uchar_t ledf, step;
 
 	/*
 	 * Update the main LED song, one note at a time. The whole thing should
@@ -76,13 +153,31 @@ clocktick()
 		hbclock -= 10;
 		_setled(ledf = (radio.heart_beat & 0x8000) ? 1 : 0);
 		radio.heart_beat = (radio.heart_beat << 1) | ledf;
+#ifdef LIBRADIO_TICKLESS
+		ledon = ledf;
+#endif
 	}
 	/*
 	 * Only track the time of day if we've been given some sort
-	 * of useful date value via external comms.
+	 * of useful date value via external comms. With LIBRADIO_DRIFT,
+	 * every so often drop or add a 10ms step, to allow for the
+	 * estimated drift of our crystal.
 	 */
 	if (radio.tens_of_minutes != 0xff) {
-		if ((radio.ms_ticks += radio.period) >= 60000) {
+		step = radio.period;
+#ifdef LIBRADIO_DRIFT
+		slew_acc += (long )radio.time_drift * radio.period;
+		if (slew_acc >= DRIFT_SLEW_UNIT) {
+			slew_acc -= DRIFT_SLEW_UNIT;
+			slew_steps++;
+			step--;
+		} else if (slew_acc <= -DRIFT_SLEW_UNIT) {
+			slew_acc += DRIFT_SLEW_UNIT;
+			slew_steps--;
+			step++;
+		}
+#endif
+		if ((radio.ms_ticks += step) >= 60000) {
 			radio.ms_ticks = 0;
 			radio.tens_of_minutes++;
 		}
@@ -105,6 +200,197 @@ clocktick()
 		elapsed_second = 1;
 	}
 	radio.all_ticks++;
+	radio.uptime += radio.period * 10;
+	if (timer_armed && (long )(radio.uptime - timer_next) >= 0)
+		timer_scan();
+}
+
+/*
+ * Move any armed timers which have expired over to timer_due, and work
+ * out the next expiry. Called with interrupts disabled.
+ */
+void
+timer_scan()
+{
+	uchar_t i, bit;
+	long delta, min = 0;
+
+	for (i = 0, bit = 1; i < LIBRADIO_NTIMERS; i++, bit <<= 1) {
+		if ((timer_armed & bit) == 0)
+			continue;
+		if ((delta = (long )(timer_when[i] - radio.uptime)) <= 0) {
+			timer_armed &= ~bit;
+			timer_due |= bit;
+			timer_fired = 1;
+		} else if (min == 0 || delta < min) {
+			min = delta;
+			timer_next = timer_when[i];
+		}
+	}
+}
+
+#ifdef LIBRADIO_TICKLESS
+/*
+ * How many ticks from the last one counted until something needs to
+ * happen? That's when main_ticks runs out, when a requested wake-up is
+ * due, or when the LED song next changes the LED. While an SPI
+ * transaction is running, stick to single ticks so that the CTS
+ * timeouts work. Called with interrupts disabled.
+ */
+uchar_t
+clock_next()
+{
+	uchar_t n, max, h, led;
+	uint_t hb, step;
+	int delta;
+	unsigned long ms;
+
+	if ((max = 65535U / tick_counts) == 0 || pkt_busy())
+		max = 1;
+	if (radio.main_ticks != 0 && radio.main_ticks < max)
+		max = radio.main_ticks;
+	if (wake_set) {
+		if ((delta = wake_at - radio.all_ticks) <= 0)
+			wake_set = 0;
+		else if (delta < max)
+			max = delta;
+	}
+	if (timer_armed) {
+		step = radio.period * 10;
+		ms = timer_next - radio.uptime;
+		if (ms < (unsigned long )max * step)
+			max = (ms + step - 1) / step;
+	}
+	h = hbclock;
+	hb = radio.heart_beat;
+	for (n = 1; n < max; n++) {
+		if ((h += radio.period) > 10) {
+			h -= 10;
+			led = (hb & 0x8000) ? 1 : 0;
+			if (led != ledon)
+				break;
+			hb = (hb << 1) | led;
+		}
+	}
+	return(n);
+}
+#endif
+
+/*
+ * Count any whole ticks which have passed in the current Timer1
+ * period. If the compare has already happened, leave it to the
+ * interrupt. Called with interrupts disabled.
+ */
+void
+clock_credit()
+{
+#ifdef LIBRADIO_TICKLESS
+	uchar_t n, done = tick_done;
+	uint_t tcnt = TCNT1;
+
+	if (tick_counts == 0 || (TIFR1 & (1<<OCF1A)) != 0)
+		return;
+	for (n = tcnt / tick_counts; tick_done < n; tick_done++)
+		clock_step();
+	if (tick_done != done)
+		pkt_tick();
+#endif
+}
+
+/*
+ * Bring ms_ticks, all_ticks and friends up to date. Without
+ * LIBRADIO_TICKLESS, they always are.
+ */
+void
+clock_sync()
+{
+#ifdef LIBRADIO_TICKLESS
+	cli();
+	clock_credit();
+	sei();
+#endif
+}
+
+/*
+ * Something has changed (main_ticks, the LED song or a wake-up time)
+ * so the next Timer1 compare might need to come sooner. Leave a couple
+ * of counts for TCNT1 to move on while we do this. Called with
+ * interrupts disabled.
+ */
+void
+clock_reschedule()
+{
+#ifdef LIBRADIO_TICKLESS
+	uchar_t end;
+
+	if (tick_counts == 0 || (TIFR1 & (1<<OCF1A)) != 0)
+		return;
+	clock_credit();
+	if ((end = tick_done + clock_next()) >= tick_run)
+		return;
+	if ((uint_t )end * tick_counts - 1 <= TCNT1 + 2)
+		end++;
+	tick_run = end;
+	OCR1A = (uint_t )end * tick_counts - 1;
+#endif
+}
+
+/*
+ * Make sure the clock interrupt wakes us up by the time all_ticks
+ * reaches the given value.
+ */
+void
+clock_wake(uint_t when)
+{
+#ifdef LIBRADIO_TICKLESS
+	cli();
+	wake_at = when;
+	wake_set = 1;
+	clock_reschedule();
+	sei();
+#endif
+}
+
+/*
+ * Return the current time as a clock tick (all_ticks, including any not
+ * yet counted) and the Timer1 count within that tick. Called with
+ * interrupts disabled, so if the timer has just wrapped, the clock
+ * interrupt won't have dealt with it yet.
+ */
+uint_t
+clock_counts(uint_t *ticksp)
+{
+	uint_t tcnt = TCNT1;
+
+	*ticksp = radio.all_ticks;
+#ifdef LIBRADIO_TICKLESS
+	if (tick_counts != 0) {
+		if ((TIFR1 & (1<<OCF1A)) != 0) {
+			*ticksp += tick_run - tick_done;
+			return(TCNT1);
+		}
+		*ticksp += tcnt / tick_counts - tick_done;
+		return(tcnt % tick_counts);
+	}
+#endif
+	if ((TIFR1 & (1<<OCF1A)) != 0) {
+		tcnt = TCNT1;
+		(*ticksp)++;
+	}
+	return(tcnt);
+}
+
+/*
+ * Return the number of Timer1 counts in a clock tick.
+ */
+uint_t
+clock_tick_counts()
+{
+#ifdef LIBRADIO_TICKLESS
+	if (tick_counts != 0)
+		return(tick_counts);
+#endif
+	return(OCR1A + 1);
 }
 
 /*
@@ -126,8 +412,10 @@ libradio_set_delay(uint_t delay)
 {
 	radio.tick_count = delay;
 	cli();
-	if (radio.main_ticks == 0)
+	if (radio.main_ticks == 0) {
 		radio.main_ticks = delay;
+		clock_reschedule();
+	}
 	sei();
 }
 
@@ -161,12 +449,114 @@ libradio_tick_wait()
 int
 libradio_elapsed_second()
 {
-	uchar_t old_value = elapsed_second;
+	uchar_t old_value;
 
+	clock_sync();
+	old_value = elapsed_second;
 	elapsed_second = 0;
 	return(old_value);
 }
 
+/*
+ * Return the number of milliseconds since boot.
+ */
+unsigned long
+libradio_uptime()
+{
+	unsigned long now;
+
+	clock_sync();
+	cli();
+	now = radio.uptime;
+	sei();
+	return(now);
+}
+
+/*
+ * Arm a deadline timer to expire the given number of milliseconds from
+ * now. Re-arming a timer which hasn't expired just moves it. The timer
+ * goes off on the first clock tick at or after the deadline.
+ */
+void
+libradio_timer_arm(uchar_t id, unsigned long ms)
+{
+	if (id >= LIBRADIO_NTIMERS)
+		return;
+	cli();
+	clock_credit();
+	timer_when[id] = radio.uptime + ms;
+	timer_armed |= (1 << id);
+	timer_due &= ~(1 << id);
+	timer_scan();
+	clock_reschedule();
+	sei();
+}
+
+/*
+ * Cancel a deadline timer, whether or not it has expired.
+ */
+void
+libradio_timer_cancel(uchar_t id)
+{
+	if (id >= LIBRADIO_NTIMERS)
+		return;
+	cli();
+	timer_armed &= ~(1 << id);
+	timer_due &= ~(1 << id);
+	timer_scan();
+	sei();
+}
+
+/*
+ * Returns TRUE (once) if the given timer has expired.
+ */
+uchar_t
+libradio_timer_expired(uchar_t id)
+{
+	uchar_t due;
+
+	if (id >= LIBRADIO_NTIMERS)
+		return(0);
+	clock_sync();
+	cli();
+	due = (timer_due & (1 << id)) != 0;
+	timer_due &= ~(1 << id);
+	sei();
+	return(due);
+}
+
+/*
+ * Return the number of milliseconds until the next timer expires (zero
+ * if one already has, and not been picked up) or -1 if none are armed.
+ */
+long
+libradio_timer_next()
+{
+	long delta = -1;
+
+	clock_sync();
+	cli();
+	if (timer_due != 0)
+		delta = 0;
+	else if (timer_armed != 0)
+		delta = (long )(timer_next - radio.uptime);
+	sei();
+	return(delta);
+}
+
+/*
+ * Has a deadline timer expired since the last call? Used by
+ * libradio_wait().
+ */
+int
+libradio_timer_wait()
+{
+	int fired = timer_fired;
+
+	timer_fired = 0;
+	return(fired);
+}
+
 /*
  * Set the LED "song" based on the state. Different flashing patterns
  * based on the system state.
@@ -176,5 +566,8 @@ libradio_set_song(uchar_t new_state)
 {
 	if (new_state > LIBRADIO_STATE_ACTIVE)
 		new_state = LIBRADIO_STATE_ACTIVE;
+	cli();
 	radio.heart_beat = songs[new_state];
+	clock_reschedule();
+	sei();
 }
@@ -58,20 +58,44 @@ void
 libradio_command(struct packet *pp)
 {
 	int i, len, addr, rchan;
+#ifdef LIBRADIO_FRAG
+	struct packet *fpp;
+#endif
 
 	if (pp->cmd != RADIO_CMD_ACTIVATE && radio.state < LIBRADIO_STATE_ACTIVE)
 		return;
+#ifdef LIBRADIO_RELIABLE
+	/*
+	 * Acknowledge a reliable packet, and drop it if we've seen it before.
+	 */
+	if (pp->seq != 0 && pp->node != 0 && rel_check(pp) == 0)
+		return;
+#endif
 	switch (pp->cmd) {
 	case RADIO_CMD_NOOP:
 	case RADIO_STATUS_RESPONSE:
 	case RADIO_EEPROM_RESPONSE:
+	case RADIO_CMD_ACK:
+		break;
+
+	case RADIO_CMD_FRAGMENT:
+		/*
+		 * Part of a bigger packet. Once we have all of it, run the
+		 * original command.
+		 */
+#ifdef LIBRADIO_FRAG
+		if ((fpp = libradio_frag_rx(pp)) != NULL && fpp->cmd != RADIO_CMD_FRAGMENT)
+			libradio_command(fpp);
+#endif
 		break;
 
 	case RADIO_CMD_FIRMWARE:
 		/*
 		 * Do a firmware update.
 		 */
-		// FIXME!!
+#ifdef LIBRADIO_OTA
+		ota_command(pp);
+#endif
 		break;
 
 	case RADIO_CMD_STATUS:
@@ -83,7 +107,28 @@ libradio_command(struct packet *pp)
 		rchan = pp->data[0];
 		addr = pp->data[1];
 		i = pp->data[2];
-		if ((len = fetch_status(i, statusbuffer, MAX_RESPONSE_SIZE)) > 0) {
+		if (i >= RADIO_STATUS_LINK && i < RADIO_STATUS_LINK + RADIO_STATUS_NLINK) {
+			statusbuffer[0] = i;
+			len = libradio_link_status(i, &statusbuffer[1], MAX_PAYLOAD_SIZE - 1) + 1;
+		}
+#ifdef LIBRADIO_TRACE
+		else if (i == RADIO_STATUS_TRACE)
+			len = pkt_trace_status(statusbuffer, MAX_PAYLOAD_SIZE);
+#endif
+#ifdef LIBRADIO_OTA
+		else if (i == RADIO_STATUS_OTA)
+			len = ota_status(statusbuffer, MAX_RESPONSE_SIZE);
+#endif
+		else if (i < RADIO_STATUS_LIBRARY_BASE ||
+					i >= RADIO_STATUS_LIBRARY_BASE + RADIO_STATUS_NLIBRARY)
+			len = fetch_status(i, statusbuffer, MAX_RESPONSE_SIZE);
+		else {
+			/*
+			 * Reserved for the library, but not built in.
+			 */
+			len = 0;
+		}
+		if (len > 0) {
 			printf("Sending status of %d to %d\n", len, rchan);
 			libradio_send_response(RADIO_STATUS_RESPONSE, rchan, addr, len, statusbuffer);
 		}
@@ -105,7 +150,9 @@ libradio_command(struct packet *pp)
 		}
 		radio.my_channel = pp->data[0];
 		radio.my_node_id = pp->data[1];
+		radio.last_seq = 0;
 		printf("ACTVD! [C%dN%d]\n", radio.my_channel, radio.my_node_id);
+		libradio_set_filter(radio.my_node_id);
 		libradio_set_state(LIBRADIO_STATE_ACTIVE);
 		break;
 
@@ -117,6 +164,7 @@ libradio_command(struct packet *pp)
 			break;
 		printf(">> DeACTVD\n");
 		radio.my_channel = radio.my_node_id = 0;
+		libradio_set_filter(0);
 		libradio_set_state(LIBRADIO_STATE_WARM);
 		break;
 
@@ -126,6 +174,7 @@ libradio_command(struct packet *pp)
 		 */
 		if (pp->len != 1)
 			break;
+		clock_sync();
 		radio.tens_of_minutes = pp->data[0];
 		printf(">> Set Time: %u\n", radio.tens_of_minutes);
 		break;
@@ -150,25 +199,26 @@ libradio_command(struct packet *pp)
 			break;
 		printf(">> Read EEPROM\n");
 		rchan = pp->data[0];
-		len = pp->data[1];
+		if ((len = pp->data[1]) > MAX_RESPONSE_SIZE)
+			len = MAX_RESPONSE_SIZE;
 		addr = (pp->data[2] << 8 | pp->data[3]);
 		printf("RChan %d, len:%d, addr:%d\n", rchan, len, addr);
 		for (i = 0; i < len; i++, addr++)
 			statusbuffer[i] = eeprom_read_byte((const unsigned char *)addr);
-		libradio_send_response(RADIO_EEPROM_RESPONSE, rchan, addr, len, statusbuffer);
+		libradio_send_response(RADIO_EEPROM_RESPONSE, rchan, radio.my_node_id, len, statusbuffer);
 		break;
 
 	case RADIO_CMD_WRITE_EEPROM:
 		/*
 		 * Write up to 16 bytes of EEPROM data.
 		 */
-		if (pp->len < 3 || pp->len > 22)
+		if (pp->len < 3 || pp->len > 18)
 			break;
 		printf(">> Write EEPROM (%db)\n", pp->len - 2);
 		addr = (pp->data[0] << 8 | pp->data[1]);
 		printf("Addr: %d\n", addr);
 		for (i = 0; i < (pp->len - 2); i++, addr++)
-			eeprom_write_byte((unsigned char *)addr, pp->data[i + 3]);
+			eeprom_write_byte((unsigned char *)addr, pp->data[i + 2]);
 		break;
 
 	default:
@@ -179,3 +229,29 @@ libradio_command(struct packet *pp)
 		break;
 	}
 }
+
+/*
+ * Fill in one of the link statistics status blocks. Each block
+ * (RADIO_STATUS_LINK + n) carries two of the 32-bit link counters, most
+ * significant byte first. Returns the number of bytes used.
+ */
+int
+libradio_link_status(uchar_t stype, uchar_t status[], int maxlen)
+{
+	int i, j, len = 0;
+	unsigned long val;
+
+	if (maxlen < 8 || stype < RADIO_STATUS_LINK)
+		return(0);
+	i = (stype - RADIO_STATUS_LINK) * 2;
+	for (j = 0; j < 2 && i < LIBRADIO_NLINK; i++, j++) {
+		cli();
+		val = radio.link[i];
+		sei();
+		status[len++] = (val >> 24) & 0xff;
+		status[len++] = (val >> 16) & 0xff;
+		status[len++] = (val >> 8) & 0xff;
+		status[len++] = val & 0xff;
+	}
+	return(len);
+}
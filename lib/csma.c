@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Listen-before-talk (LIBRADIO_CSMA). Before a transmission, make sure
+ * we're listening on the channel and sample the current RSSI. If it's
+ * above the threshold, somebody else is talking, so back off for a
+ * random number of clock ticks (doubling the window each time the
+ * channel is found busy) and let the caller try again later.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+
+#ifdef LIBRADIO_CSMA
+uchar_t		cca_threshold = CSMA_THRESHOLD;
+uchar_t		csma_tries[LIBRADIO_NCHANNELS];
+uint_t		csma_until[LIBRADIO_NCHANNELS];
+uint_t		csma_seed = 1;
+
+/*
+ * Clear channel assessment. Returns non-zero if it's OK to transmit on
+ * the channel. If a backoff is still running for the channel, the send
+ * is deferred. Otherwise put the radio into RX on the channel (if it
+ * isn't already), wait for it to finish tuning and for the RSSI to
+ * settle, and check the RSSI. A radio which won't go into RX counts as
+ * a busy channel.
+ */
+uchar_t
+libradio_cca(uchar_t channo)
+{
+	int i;
+	struct chstats *csp;
+
+	if (channo >= LIBRADIO_NCHANNELS)
+		return(1);
+	csp = &radio.chstats[channo];
+	if (csma_tries[channo] > 0 && !csma_expired(channo)) {
+		csp->deferred++;
+		return(0);
+	}
+	i = 0;
+	if (radio.curr_state != SI4463_STATE_RX || radio.curr_channel != channo) {
+		libradio_set_rx(channo);
+		for (; i < CSMA_TUNE_POLLS; i++)
+			if (libradio_read_frr() == SI4463_STATE_RX)
+				break;
+		/*
+		 * Give the RSSI time to catch up with the new channel.
+		 */
+		if (i < CSMA_TUNE_POLLS)
+			csma_settle();
+	}
+	/*
+	 * If the radio never made it into RX, the RSSI is meaningless, so
+	 * assume somebody is talking.
+	 */
+	if (i < CSMA_TUNE_POLLS) {
+		libradio_get_modem_status();
+		if (radio.current_rssi < cca_threshold) {
+			csma_tries[channo] = 0;
+			return(1);
+		}
+	}
+	/*
+	 * The channel is busy. Pick a random backoff from a window of
+	 * 2^tries clock ticks.
+	 */
+	csp->cca_busy++;
+	if (csma_tries[channo] < CSMA_MAX_TRIES)
+		csma_tries[channo]++;
+	csma_seed = csma_seed * 109 + 89 + TCNT1;
+	i = 1 + ((csma_seed >> 4) & ((1 << csma_tries[channo]) - 1));
+	csp->backoff += i;
+	cli();
+	clock_credit();
+	csma_until[channo] = radio.all_ticks + i;
+	sei();
+	return(0);
+}
+
+/*
+ * Wait for CSMA_RSSI_SETTLE Timer1 counts after the radio has gone
+ * into RX, so that the RSSI reflects the channel and not the tune.
+ */
+void
+csma_settle()
+{
+	uint_t ticks, start_ticks, start;
+	long elapsed;
+
+	cli();
+	start = clock_counts(&start_ticks);
+	sei();
+	do {
+		cli();
+		elapsed = clock_counts(&ticks);
+		sei();
+		elapsed += (long )(ticks - start_ticks) * (long )clock_tick_counts() - (long )start;
+	} while (elapsed < CSMA_RSSI_SETTLE);
+}
+
+/*
+ * Has the backoff for this channel run out?
+ */
+uchar_t
+csma_expired(uchar_t channo)
+{
+	int delta;
+
+	if (channo >= LIBRADIO_NCHANNELS)
+		return(1);
+	cli();
+	clock_credit();
+	delta = radio.all_ticks - csma_until[channo];
+	sei();
+	return(delta >= 0);
+}
+
+/*
+ * Sleep until the backoff for this channel runs out. The check and the
+ * sleep are done with interrupts off, so that the clock tick which ends
+ * the backoff can't slip in between them.
+ */
+void
+csma_wait(uchar_t channo)
+{
+	clock_wake(csma_until[channo]);
+	cli();
+	for (;;) {
+		clock_credit();
+		if ((int )(radio.all_ticks - csma_until[channo]) >= 0)
+			break;
+		_snooze();
+	}
+	sei();
+}
+
+/*
+ * Set the RSSI level above which the channel is considered busy. The
+ * RSSI is in half-dB steps, with zero at roughly -130dBm.
+ */
+void
+libradio_set_cca_threshold(uchar_t level)
+{
+	cca_threshold = level;
+}
+
+/*
+ * Print the per-channel CSMA statistics.
+ */
+void
+libradio_csma_stats(uchar_t clear)
+{
+	int i;
+	struct chstats *csp;
+
+	for (i = 0, csp = radio.chstats; i < LIBRADIO_NCHANNELS; i++, csp++) {
+		printf("CSMA%d:B%u,K%u,D%u\n", i, csp->cca_busy, csp->backoff, csp->deferred);
+		if (clear)
+			csp->cca_busy = csp->backoff = csp->deferred = 0;
+	}
+}
+#endif
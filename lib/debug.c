@@ -86,6 +86,7 @@ libradio_debug()
 		break;
 	case 'h':
 		libradio_handle_packet();
+		libradio_dispatch();
 		printf("handle packet\n");
 		break;
 	case 'p':
@@ -129,6 +130,48 @@ libradio_debug()
 	case 'P':
 		libradio_get_property(0x100, 4);
 		break;
+	case 'W':
+	case 'w':
+		pkt_cts_stats(ch == 'W');
+		break;
+	case 'X':
+	case 'x':
+		pkt_spi_stats(ch == 'X');
+		break;
+	case 'E':
+	case 'e':
+		libradio_crc_stats(ch == 'E');
+		break;
+	case 'T':
+	case 't':
+		libradio_time_stats(ch == 'T');
+		break;
+	case 'Q':
+	case 'q':
+		libradio_rxq_stats(ch == 'Q');
+		break;
+	case 'K':
+	case 'k':
+		libradio_event_stats(ch == 'K');
+		break;
+#ifdef LIBRADIO_TRACE
+	case 'L':
+	case 'l':
+		pkt_trace_stats(ch == 'L');
+		break;
+#endif
+#ifdef LIBRADIO_CSMA
+	case 'B':
+	case 'b':
+		libradio_csma_stats(ch == 'B');
+		break;
+#endif
+#ifdef LIBRADIO_OTA
+	case 'U':
+	case 'u':
+		libradio_ota_stats(ch == 'U');
+		break;
+#endif
 	default:
 		putchar('\n');
 	}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A small, run-to-completion event scheduler for applications. Rather
+ * than every application picking through the libradio_wait() bitmask
+ * itself, handlers are registered in a fixed table of slots, each with
+ * the set of wait reasons it cares about. Slot 0 has the highest
+ * priority, so the radio handler (libradio_rxevent()) should normally
+ * go there. Each call to libradio_event_run() sleeps until something
+ * happens and then calls every interested handler, in slot order. A
+ * handler can also be run on request, by posting it (from the main
+ * code or from an interrupt) with libradio_event_post().
+ *
+ * There is no preemption, so a handler which takes too long holds up
+ * everything after it (including the next look at the radio). The time
+ * spent in each handler is measured in Timer1 counts to make those easy
+ * to find (debug key k).
+ */
+#include <stdio.h>
+#include <avr/io.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+
+/*
+ * The handler table. For each slot, the handler function, the wait
+ * reasons which trigger it, the number of calls, and the longest and
+ * total time spent in the handler (in Timer1 counts).
+ */
+struct event	{
+	void			(*func)(uchar_t);
+	uchar_t			mask;
+	uint_t			calls;
+	uint_t			max_counts;
+	unsigned long	total_counts;
+};
+
+struct event		events[LIBRADIO_NEVENTS];
+volatile uchar_t	event_posted;
+
+/*
+ * Register a handler in the given slot, replacing whatever was there.
+ * The mask is a set of LIBRADIO_WAIT_ bits which should trigger the
+ * handler. A NULL function empties the slot.
+ */
+void
+libradio_event_add(uchar_t slot, uchar_t mask, void (*func)(uchar_t))
+{
+	struct event *evp;
+
+	if (slot >= LIBRADIO_NEVENTS)
+		return;
+	evp = &events[slot];
+	cli();
+	evp->func = func;
+	evp->mask = mask;
+	evp->calls = evp->max_counts = 0;
+	evp->total_counts = 0;
+	event_posted &= ~(1 << slot);
+	sei();
+}
+
+/*
+ * Ask for the handler in the given slot to be run on the next pass,
+ * whatever else happens. Safe to call from an interrupt.
+ */
+void
+libradio_event_post(uchar_t slot)
+{
+	uchar_t sreg = SREG;
+
+	if (slot >= LIBRADIO_NEVENTS || events[slot].func == NULL)
+		return;
+	cli();
+	event_posted |= (1 << slot);
+	SREG = sreg;
+}
+
+/*
+ * Call a handler, and account for the time it took.
+ */
+void
+event_call(struct event *evp, uchar_t status)
+{
+	uint_t ticks, start_ticks, start;
+	long elapsed;
+
+	cli();
+	start = clock_counts(&start_ticks);
+	sei();
+	evp->func(status);
+	cli();
+	elapsed = clock_counts(&ticks);
+	sei();
+	elapsed += (long )(ticks - start_ticks) * (long )clock_tick_counts() - (long )start;
+	if (elapsed > 65535L)
+		elapsed = 65535L;
+	evp->calls++;
+	evp->total_counts += elapsed;
+	if (evp->max_counts < elapsed)
+		evp->max_counts = elapsed;
+}
+
+/*
+ * One pass of the scheduler. Wait for something to happen, and then
+ * call each handler which is interested (or has been posted) in
+ * priority order. The handler is passed the wait reasons which
+ * triggered it, plus LIBRADIO_WAIT_POSTED if it was posted.
+ */
+void
+libradio_event_run()
+{
+	uchar_t i, bit, status, posted;
+	struct event *evp;
+
+	status = libradio_wait();
+	for (i = 0, bit = 1, evp = events; i < LIBRADIO_NEVENTS; i++, bit <<= 1, evp++) {
+		cli();
+		posted = event_posted & bit;
+		event_posted &= ~bit;
+		sei();
+		if (evp->func == NULL)
+			continue;
+		if (posted)
+			event_call(evp, (status & evp->mask) | LIBRADIO_WAIT_POSTED);
+		else if ((status & evp->mask) != 0)
+			event_call(evp, status & evp->mask);
+	}
+}
+
+/*
+ * Print the handler statistics. For each slot in use, the number of
+ * calls, and the longest and total time spent in the handler.
+ */
+void
+libradio_event_stats(uchar_t clear)
+{
+	uchar_t i;
+	struct event *evp;
+
+	for (i = 0, evp = events; i < LIBRADIO_NEVENTS; i++, evp++) {
+		if (evp->func == NULL)
+			continue;
+		printf("EV%d:C%u,M%u,T%lu\n", i, evp->calls,
+					evp->max_counts, evp->total_counts);
+		if (clear) {
+			evp->calls = evp->max_counts = 0;
+			evp->total_counts = 0;
+		}
+	}
+}
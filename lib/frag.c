@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Fragmentation and reassembly (LIBRADIO_FRAG). A packet payload is at
+ * most MAX_PAYLOAD_SIZE bytes, so anything bigger (up to LIBRADIO_FRAG_MAX)
+ * is chopped up into RADIO_CMD_FRAGMENT packets. The first two bytes of
+ * each fragment are the original command, and a header byte with a
+ * two-bit message tag, the fragment number and the number of the last
+ * fragment. The rest is FRAG_CHUNK bytes of the original payload (or
+ * whatever is left, for the last fragment).
+ *
+ * The receiver puts the message back together in one of a handful of
+ * buffers, one per sending node. The buffer is a packet followed by
+ * enough room for the rest of the payload, so the reassembled packet
+ * can be passed to libradio_command() or the controller like any
+ * other (with a length of more than MAX_PAYLOAD_SIZE). A message which
+ * isn't finished within LIBRADIO_FRAG_TIMEOUT ms is thrown away, as is
+ * a partial message when a fragment from a different one turns up.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+
+#ifdef LIBRADIO_FRAG
+#define FRAG_TAG(h)			(((h) >> 6) & 03)
+#define FRAG_INDEX(h)		(((h) >> 3) & 07)
+#define FRAG_LAST(h)		((h) & 07)
+
+#if LIBRADIO_FRAG_MAX <= MAX_PAYLOAD_SIZE || LIBRADIO_FRAG_MAX > FRAG_MAX_FRAGS * FRAG_CHUNK
+#error "LIBRADIO_FRAG_MAX is out of range"
+#endif
+
+/*
+ * A reassembly buffer. The node it's for, the tag and last fragment
+ * number of the message (as a header byte with no index), a bitmask of
+ * the fragments we have, and when to give up on it. The packet must be
+ * followed directly by the extra room.
+ */
+struct fragbuf	{
+	uchar_t			node;
+	uchar_t			hdr;
+	uchar_t			have;
+	unsigned long	expire;
+	struct packet	packet;
+	uchar_t			more[LIBRADIO_FRAG_MAX - MAX_PAYLOAD_SIZE];
+};
+
+struct fragbuf	fragbufs[LIBRADIO_FRAG_BUFS];
+uchar_t			frag_next_tag;
+
+/*
+ * Return the number of fragments needed for a payload of len bytes.
+ */
+uchar_t
+libradio_frag_count(uchar_t len)
+{
+	if (len > LIBRADIO_FRAG_MAX)
+		len = LIBRADIO_FRAG_MAX;
+	return(len == 0 ? 1 : (len + FRAG_CHUNK - 1) / FRAG_CHUNK);
+}
+
+/*
+ * Return a new message tag, for the next fragmented message.
+ */
+uchar_t
+libradio_frag_tag()
+{
+	frag_next_tag = (frag_next_tag + 1) & 03;
+	return(frag_next_tag);
+}
+
+/*
+ * Fill in the payload of fragment number index, for the given command
+ * and (full) payload. Returns the length of the fragment payload.
+ */
+uchar_t
+libradio_frag_pack(uchar_t frag[], uchar_t cmd, uchar_t tag, uchar_t buffer[], uchar_t len, uchar_t index)
+{
+	uchar_t i, n, off = index * FRAG_CHUNK;
+
+	if (len > LIBRADIO_FRAG_MAX)
+		len = LIBRADIO_FRAG_MAX;
+	frag[0] = cmd;
+	frag[1] = (tag << 6) | (index << 3) | (libradio_frag_count(len) - 1);
+	if ((n = len - off) > FRAG_CHUNK)
+		n = FRAG_CHUNK;
+	for (i = 0; i < n; i++)
+		frag[FRAG_HEADER_LEN + i] = buffer[off + i];
+	return(n + FRAG_HEADER_LEN);
+}
+
+/*
+ * Send a response which is too big for one packet, as a series of
+ * fragments (see libradio_send_response()).
+ */
+void
+frag_send(uchar_t cmd, uchar_t chan, uchar_t addr, uchar_t len, uchar_t buffer[])
+{
+	uchar_t i, n, nfrags, tag;
+	uchar_t frag[MAX_PAYLOAD_SIZE];
+
+	nfrags = libradio_frag_count(len);
+	tag = libradio_frag_tag();
+	for (i = 0; i < nfrags; i++) {
+		n = libradio_frag_pack(frag, cmd, tag, buffer, len, i);
+		libradio_send_response(RADIO_CMD_FRAGMENT, chan, addr, n, frag);
+	}
+}
+
+/*
+ * A fragment has arrived. Find (or set up) the buffer for the sending
+ * node and copy the fragment into place. Returns the reassembled packet
+ * once we have all of it, otherwise NULL. The packet stays valid until
+ * the next fragment from the same node arrives.
+ */
+struct packet *
+libradio_frag_rx(struct packet *pp)
+{
+	uchar_t i, hdr, index, n, *cp;
+	unsigned long now;
+	struct fragbuf *fbp, *xfbp;
+
+	if (pp->cmd != RADIO_CMD_FRAGMENT || pp->len <= FRAG_HEADER_LEN)
+		return(NULL);
+	hdr = pp->data[1];
+	if ((index = FRAG_INDEX(hdr)) > FRAG_LAST(hdr) ||
+				FRAG_LAST(hdr) >= libradio_frag_count(LIBRADIO_FRAG_MAX))
+		return(NULL);
+	now = libradio_uptime();
+	/*
+	 * Look for this node's buffer, or else the one which has been
+	 * idle the longest (an empty buffer beats them all).
+	 */
+	for (i = 0, fbp = fragbufs, xfbp = NULL; i < LIBRADIO_FRAG_BUFS; i++, fbp++) {
+		if (fbp->have != 0 && (long )(now - fbp->expire) >= 0) {
+			radio.frag_lost++;
+			fbp->have = 0;
+		}
+		if (fbp->have != 0 && fbp->node == pp->node)
+			break;
+		if (xfbp == NULL || fbp->have == 0 ||
+				(xfbp->have != 0 && (long )(fbp->expire - xfbp->expire) < 0))
+			xfbp = fbp;
+	}
+	if (i == LIBRADIO_FRAG_BUFS) {
+		if ((fbp = xfbp)->have != 0)
+			radio.frag_lost++;
+		fbp->have = 0;
+	}
+	/*
+	 * A fragment from a different message means the old one is
+	 * never going to be finished.
+	 */
+	if (fbp->have != 0 && fbp->hdr != (hdr & ~070)) {
+		radio.frag_lost++;
+		fbp->have = 0;
+	}
+	if (fbp->have == 0) {
+		fbp->node = pp->node;
+		fbp->hdr = hdr & ~070;
+		fbp->expire = now + LIBRADIO_FRAG_TIMEOUT;
+		fbp->packet = *pp;
+		fbp->packet.cmd = pp->data[0];
+		fbp->packet.len = 0;
+#ifdef LIBRADIO_RELIABLE
+		/*
+		 * Each fragment has already been through rel_check(), so
+		 * don't let the reassembled packet go through it again.
+		 */
+		fbp->packet.seq = 0;
+#endif
+	}
+	/*
+	 * Copy it in. The last fragment tells us how long the whole
+	 * thing is.
+	 */
+	n = pp->len - FRAG_HEADER_LEN;
+	cp = &fbp->packet.data[index * FRAG_CHUNK];
+	for (i = 0; i < n && index * FRAG_CHUNK + i < LIBRADIO_FRAG_MAX; i++)
+		*cp++ = pp->data[FRAG_HEADER_LEN + i];
+	if (index == FRAG_LAST(hdr))
+		fbp->packet.len = index * FRAG_CHUNK + i;
+	fbp->have |= (1 << index);
+	if (fbp->have != (uchar_t )((2 << FRAG_LAST(hdr)) - 1))
+		return(NULL);
+	fbp->have = 0;
+	return(&fbp->packet);
+}
+#endif
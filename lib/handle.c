@@ -29,7 +29,9 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  * ABSTRACT
- * Handle a received packet.
+ * Handle a received packet. Packets are read from the radio into a
+ * queue (of LIBRADIO_RXQ_DEPTH packets) and dispatched from there by
+ * the main loop.
  */
 #include <stdio.h>
 #include <avr/io.h>
@@ -39,57 +41,171 @@
 #include "libradio.h"
 #include "internal.h"
 
-struct channel	rxchan;
+struct channel	rxchan[SI4463_FIFO_PACKETS];
 struct channel	txchan;
+struct packet	rxq[LIBRADIO_RXQ_DEPTH];
+uchar_t			rxq_head;
+uchar_t			rxq_count;
 
 /*
- * Receive a packet from the radio, and call libradio_command() with
- * the received packet if the packet was intended for us.
+ * Pull every packet out of the radio FIFO and add the ones intended for
+ * us to the RX queue. Nothing is dispatched here, so the FIFO is always
+ * emptied before any (possibly slow) commands are run. If the queue is
+ * full, the packet is dropped and counted.
  */
 void
 libradio_handle_packet()
 {
-	struct channel *chp = &rxchan;
+	uchar_t i, n;
+	struct channel *chp;
 
-	/*
-	 * Look for a received packet.
-	 */
-	if (libradio_recv(chp, radio.my_channel)) {
-		if (chp->packet.node == 0 || chp->packet.node == radio.my_node_id)
-			libradio_command(&chp->packet);
+	do {
+		n = libradio_recv_burst(rxchan, SI4463_FIFO_PACKETS, radio.my_channel);
+		for (i = 0, chp = rxchan; i < n; i++, chp++) {
+			if (chp->packet.node != 0 && chp->packet.node != radio.my_node_id)
+				continue;
+			if (rxq_count >= LIBRADIO_RXQ_DEPTH) {
+				radio.rxq_overflow++;
+				continue;
+			}
+			rxq[(rxq_head + rxq_count) % LIBRADIO_RXQ_DEPTH] = chp->packet;
+			if (++rxq_count > radio.rxq_max)
+				radio.rxq_max = rxq_count;
+		}
+	} while (n == SI4463_FIFO_PACKETS);
+}
+
+/*
+ * The radio IRQ has fired. Empty the FIFO into the queue, clear the
+ * interrupt (if reading a packet didn't) and re-enable the IRQ.
+ */
+void
+rxq_service()
+{
+	libradio_handle_packet();
+	if ((radio.ph_pending & SI4463_PH_PACKET_RX) == 0)
+		libradio_clear_int();
+	libradio_irq_enable(1);
+}
+
+/*
+ * Run libradio_command() for each packet in the RX queue. The packet
+ * stays in the queue until the command has finished with it. If the
+ * radio IRQ fires while a command is running, empty the FIFO before
+ * moving on to the next one.
+ */
+void
+libradio_dispatch()
+{
+	while (rxq_count > 0) {
+		libradio_command(&rxq[rxq_head]);
+		rxq_head = (rxq_head + 1) % LIBRADIO_RXQ_DEPTH;
+		rxq_count--;
+		if (libradio_irq_fired() && !libradio_tx_intr())
+			rxq_service();
+	}
+}
+
+/*
+ * Return the number of packets waiting in the RX queue.
+ */
+uchar_t
+libradio_rxq_depth()
+{
+	return(rxq_count);
+}
+
+/*
+ * Print the RX queue statistics.
+ */
+void
+libradio_rxq_stats(uchar_t clear)
+{
+	printf("RXQ:D%u,M%u,O%u,F%u\n", rxq_count, radio.rxq_max,
+					radio.rxq_overflow, radio.frag_lost);
+	if (clear) {
+		radio.rxq_max = rxq_count;
+		radio.rxq_overflow = radio.frag_lost = 0;
 	}
 }
 
 /*
  * Send a response packet to the remote channel/address. Used whenever
  * we receive a request for information such as a STATUS request or an
- * EEPROM read request.
+ * EEPROM read request. If an earlier response is still going out, wait
+ * for it first. This one is left to go out on its own. Anything too big
+ * for a single packet is sent in fragments (see frag.c), or without
+ * LIBRADIO_FRAG, cut short.
  */
 void
 libradio_send_response(uchar_t cmd, uchar_t chan, uchar_t addr, uchar_t len, uchar_t buffer[])
 {
-	int i;
+	int i, n;
 	struct channel *chp = &txchan;
 
+	if (len > MAX_PAYLOAD_SIZE) {
+#ifdef LIBRADIO_FRAG
+		frag_send(cmd, chan, addr, len, buffer);
+		return;
+#else
+		len = MAX_PAYLOAD_SIZE;
+#endif
+	}
+	libradio_tx_flush();
 	chp->state = LIBRADIO_CHSTATE_TRANSMIT;
 	chp->priority = 10;
 	chp->packet.node = addr;
 	chp->packet.len = len;
 	chp->packet.cmd = cmd;
-	if (len > MAX_PAYLOAD_SIZE)
-		len = MAX_PAYLOAD_SIZE;
+#ifdef LIBRADIO_RELIABLE
+	chp->packet.seq = 0;
+#endif
 	for (i = 0; i < len; i++)
 		chp->packet.data[i] = buffer[i];
-	if (libradio_send(chp, chan) != 0) {
-		chp->state = LIBRADIO_CHSTATE_EMPTY;
-		chp->priority = 0;
+#ifdef LIBRADIO_CSMA
+	/*
+	 * If the channel is busy, sleep through the backoff and try again.
+	 */
+	for (i = 0; (n = libradio_send(chp, chan)) == 0 && i < CSMA_MAX_TRIES; i++)
+		csma_wait(chan);
+#else
+	n = libradio_send(chp, chan);
+#endif
+	if (n == 0) {
+		libradio_recv_start();
+		return;
 	}
 	/*
-	 * Busy-wait for the transmission to end. Ideally we'd use the
-	 * state machine and not go listening for new RX packets until
-	 * this was done (or one clock tick).
+	 * Don't wait for the transmission to end. The PACKET_SENT interrupt
+	 * will put us back into RX on our own channel.
 	 */
-	while (libradio_request_device_status() == SI4463_STATE_TX)
-		;
-	libradio_recv_start();
+	chp->state = LIBRADIO_CHSTATE_EMPTY;
+	chp->priority = 0;
+	radio.tx_state = LIBRADIO_TX_RESPOND;
+}
+
+#ifdef LIBRADIO_RELIABLE
+/*
+ * A unicast packet from the controller, with a sequence number. If it
+ * asks for an ACK, send one straight away, even if it's a duplicate (as
+ * our last ACK may have been lost). The ACK carries our own node ID, so
+ * no other client will pick it up, and says whether we dropped the
+ * packet as a duplicate. Returns zero if we've already seen the packet.
+ */
+uchar_t
+rel_check(struct packet *pp)
+{
+	uchar_t ack[2];
+
+	ack[0] = pp->seq & RADIO_SEQ_MASK;
+	ack[1] = (ack[0] == radio.last_seq);
+	if (pp->seq & RADIO_SEQ_ACKREQ)
+		libradio_send_response(RADIO_CMD_ACK, radio.my_channel, radio.my_node_id, 2, ack);
+	if (ack[1]) {
+		radio.link[LINK_REL_DUPS]++;
+		return(0);
+	}
+	radio.last_seq = ack[0];
+	return(1);
 }
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Fast channel hopping. A START_RX or START_TX on a new channel takes the
+ * radio through a full synthesizer tune. If the radio is already in RX,
+ * the RX_HOP command moves it straight to a new frequency, using a VCO
+ * calibration count supplied by the caller. The frequency and VCO count
+ * for each channel are worked out once, at startup, from the
+ * FREQ_CONTROL properties in radio_config.h.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+#include "radio_config.h"
+
+/*
+ * The SET_PROPERTY command for the FREQ_CONTROL group. After the four
+ * command bytes come INTE, FRAC (3 bytes), CHANNEL_STEP_SIZE (2 bytes),
+ * W_SIZE and VCOCNT_RX_ADJ.
+ */
+const uchar_t	freq_control[] PROGMEM = { RF_FREQ_CONTROL_INTE_8 };
+
+uchar_t			hop_table[LIBRADIO_NCHANNELS][SI4463_HOP_LEN];
+char			hop_rxadj;
+
+/*
+ * Build the hop table. Channel N is at (INTE + FRAC/2^19) plus N times
+ * the channel step, where FRAC must stay in the range 2^19 to 2^20-1.
+ * The VCO calibration count is the number of VCO/4 cycles in W_SIZE
+ * crystal cycles, which (as the VCO runs at 2 x XO x N) works out as
+ * N x W_SIZE / 2, independent of the crystal frequency.
+ */
+void
+hop_init()
+{
+	uchar_t i, inte, wsize, *cp;
+	unsigned long frac, step, vco;
+
+	inte = pgm_read_byte(&freq_control[4]);
+	frac = ((unsigned long )pgm_read_byte(&freq_control[5]) << 16) |
+			((unsigned long )pgm_read_byte(&freq_control[6]) << 8) |
+			pgm_read_byte(&freq_control[7]);
+	step = ((unsigned long )pgm_read_byte(&freq_control[8]) << 8) |
+			pgm_read_byte(&freq_control[9]);
+	wsize = pgm_read_byte(&freq_control[10]);
+	hop_rxadj = (char )pgm_read_byte(&freq_control[11]);
+	for (i = 0; i < LIBRADIO_NCHANNELS; i++, frac += step) {
+		while (frac >= 0x100000L) {
+			frac -= 0x80000L;
+			inte++;
+		}
+		vco = (((((unsigned long )inte << 19) + frac) >> 4) * wsize) >> 16;
+		cp = hop_table[i];
+		*cp++ = inte;
+		*cp++ = (frac >> 16) & 0xff;
+		*cp++ = (frac >> 8) & 0xff;
+		*cp++ = frac & 0xff;
+		*cp++ = (vco >> 8) & 0xff;
+		*cp = vco & 0xff;
+	}
+}
+
+/*
+ * Hop to a new RX channel without going through a full tune. This only
+ * works if the radio is already in RX, in which case we send an RX_HOP
+ * with the precomputed frequency for the channel. The VCO count in RX is
+ * adjusted by VCOCNT_RX_ADJ. Returns zero if the hop isn't possible and
+ * the caller should use START_RX instead.
+ */
+uchar_t
+libradio_rx_hop(uchar_t channo)
+{
+	int i, vco;
+	uchar_t *cp;
+
+	if (channo >= LIBRADIO_NCHANNELS || radio.curr_state != SI4463_STATE_RX)
+		return(0);
+	pkt_data[0] = SI4463_RX_HOP;
+	for (i = 0, cp = hop_table[channo]; i < SI4463_HOP_LEN; i++)
+		pkt_data[i + 1] = *cp++;
+	vco = ((pkt_data[5] << 8) | pkt_data[6]) + hop_rxadj;
+	pkt_data[5] = (vco >> 8) & 0xff;
+	pkt_data[6] = vco & 0xff;
+	if ((i = pkt_send(SI4463_HOP_LEN + 1, 0)) != SPI_SEND_OK)
+		return(pkt_error(i));
+	radio.curr_channel = channo;
+	return(1);
+}
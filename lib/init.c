@@ -77,6 +77,8 @@ libradio_init(uchar_t c1, uchar_t c2, uchar_t n1, uchar_t n2)
 	radio.num1 = n1;
 	radio.num2 = n2;
 	pkt_init();
+	hop_init();
+	drift_init();
 	libradio_get_fifo_info(03);
 }
 
@@ -39,6 +39,21 @@
 #define MAX_SPI_BLOCK				20
 
 #define SI4463_PACKET_LEN			16
+#define SI4463_RX_FIFO_LEN			64
+#define SI4463_FIFO_PACKETS			(SI4463_RX_FIFO_LEN / SI4463_PACKET_LEN)
+
+/*
+ * The smallest and largest frames in the FIFO. In variable-length mode,
+ * a frame is a length byte followed by one or more packets, with no
+ * padding.
+ */
+#ifdef LIBRADIO_VARLEN
+#define SI4463_MIN_FRAME			(1 + PACKET_HEADER_LEN)
+#define SI4463_MAX_FRAME			(1 + MAX_FIFO_SIZE)
+#else
+#define SI4463_MIN_FRAME			SI4463_PACKET_LEN
+#define SI4463_MAX_FRAME			SI4463_PACKET_LEN
+#endif
 
 #define SI4463_NOP					0x00
 #define SI4463_PART_INFO			0x01
@@ -69,12 +84,116 @@
 #define SI4463_GET_MODEM_STATUS		0x22
 #define SI4463_START_RX				0x32
 #define SI4463_RX_HOP				0x36
+#define SI4463_HOP_LEN				6
 #define SI4463_READ_RX_FIFO			0x77
 
 #define SI4463_GET_ADC_READING		0x14
 #define SI4463_GET_PH_STATUS		0x21
 #define SI4463_GET_CHIP_STATUS		0x23
 
+#define SI4463_PH_FILTER_MATCH		0x80
+#define SI4463_PH_FILTER_MISS		0x40
+#define SI4463_PH_PACKET_SENT		0x20
+#define SI4463_PH_PACKET_RX			0x10
+#define SI4463_PH_CRC_ERROR			0x08
+
+/*
+ * A single SET_PROPERTY command can set up to twelve properties in the
+ * same group. Properties changed since the configuration blob was
+ * loaded are remembered in a shadow table (see property.c), with room
+ * for LIBRADIO_PROP_SHADOW of them.
+ */
+#define SI4463_MAX_PROPS			12
+#ifndef LIBRADIO_PROP_SHADOW
+#define LIBRADIO_PROP_SHADOW		16
+#endif
+
+/*
+ * The packet handler match engine. Match 1 checks the node ID (which is
+ * the third byte of the frame, after the time stamp) and match 2 is
+ * OR-ed in to accept broadcasts.
+ */
+#define SI4463_PROP_MATCH			0x3000
+#define SI4463_MATCH_EN				0x80
+#define SI4463_MATCH_OR				0x80
+#define SI4463_MATCH_OFFSET			2
+
+/*
+ * Low duty cycle (LIBRADIO_SNIFF) receive. The wake-up timer runs off the
+ * 32kHz RC oscillator, with a period of 4 x M x 2^R / 32768 seconds. Every
+ * 31.25ms (M = 256), the radio listens for preamble for 1.95ms (LDC = 16)
+ * and then goes back to sleep, unless it hears something. An activation
+ * sent on the sleepy channel (zero) uses a 255 byte (40.8ms) preamble,
+ * so that at least one sniff lands inside it. Once it has heard that,
+ * the client stays in RX, so nothing else needs the long preamble.
+ */
+#define SI4463_PROP_WUT				0x0004
+#define SI4463_PROP_PREAMBLE_TX_LEN	0x1000
+#define SI4463_WUT_LDC_RX			0x40
+#define SI4463_WUT_EN				0x02
+#define SI4463_WUT_CAL_EN			0x01
+#define SI4463_WUT_SLEEP			0x20
+#define SI4463_PREAMBLE_LEN			8
+
+#define SNIFF_WUT_M					256
+#define SNIFF_WUT_R					0
+#define SNIFF_WUT_LDC				16
+#define SNIFF_PREAMBLE_LEN			255
+
+#define SNIFF_WAKEUP(ch, pp)	((ch) == 0 && (pp)->cmd == RADIO_CMD_ACTIVATE)
+
+/*
+ * Network time synchronization (see pkt_timesync()). Everything is in
+ * Timer1 counts, which are 4us each, and there are 2,500 in a 10ms tick.
+ * At 50kbps a byte takes 40 counts on air. The sender takes about 400us
+ * to get from time-stamping the packet to the start of the preamble, and
+ * then there's the preamble and two-byte sync word. At the receiver,
+ * the sync word is followed by the frame and the two-byte CRC before the
+ * packet handler raises the IRQ.
+ */
+#define TSYNC_TICK_COUNTS			2500
+#define TSYNC_BYTE_COUNTS			40
+#define TSYNC_TX_SETUP				100
+
+#ifdef LIBRADIO_SNIFF
+#define TSYNC_PREAMBLE(pp)	(SNIFF_WAKEUP(radio.curr_channel, pp) ? SNIFF_PREAMBLE_LEN : SI4463_PREAMBLE_LEN)
+#else
+#define TSYNC_PREAMBLE(pp)	SI4463_PREAMBLE_LEN
+#endif
+#define TSYNC_TX_LATENCY(pp)	(TSYNC_TX_SETUP + (long )TSYNC_BYTE_COUNTS * (TSYNC_PREAMBLE(pp) + 2))
+
+/*
+ * Clock drift estimation (LIBRADIO_DRIFT). The drift is kept in units
+ * of 0.01ppm, and is only re-estimated over intervals of between 30
+ * seconds and 300 seconds (in uptime ms). A drift of one unit moves
+ * ms_ticks by one 10ms step in 10^8 ticks' worth of 10ms (slew_steps
+ * counts the steps taken). The estimate
+ * is saved in the last four bytes of EEPROM (with an inverted copy as
+ * a check) whenever it moves by more than half a ppm.
+ */
+#define DRIFT_MIN_TIME				30000L
+#define DRIFT_MAX_TIME				300000L
+#define DRIFT_MAX					30000
+#define DRIFT_SAVE_DELTA			50
+#define DRIFT_SLEW_UNIT				100000000L
+#ifndef LIBRADIO_DRIFT_EEPROM
+#define LIBRADIO_DRIFT_EEPROM		(E2END - 3)
+#endif
+
+#ifdef LIBRADIO_VARLEN
+#define TSYNC_FRAME_LEN		(1 + pkt_rxflen)
+#else
+#define TSYNC_FRAME_LEN		SI4463_PACKET_LEN
+#endif
+
+/*
+ * The FRR_CTL_A_MODE property, and the value radio_config.h gives it.
+ * The chip default is 0x01, so reading back our value tells us that the
+ * configuration survived a sleep.
+ */
+#define SI4463_PROP_FRR_CTL_A_MODE	0x0200
+#define SI4463_FRR_CURRENT_STATE	0x09
+
 #define SI4463_STATE_NOCHANGE		0
 #define SI4463_STATE_SLEEP			1
 #define SI4463_STATE_SPI_ACTIVE		2
@@ -94,6 +213,158 @@
 #define SPI_SEND_ACK_FAIL		3
 #define SPI_SEND_READ_FAIL		4
 #define SPI_SEND_TIMEOUT		5
+#define SPI_SEND_BUSY			6
+
+/*
+ * An SPI transaction for the interrupt-driven engine in packet.c. The
+ * first send_len bytes of buf[] are clocked out to the radio, we wait
+ * for CTS, and then recv_len bytes of the response are read back into
+ * buf[]. The status is SPI_SEND_BUSY until the transaction completes,
+ * at which point it is one of the SPI_SEND_{x} codes above and done()
+ * (if it isn't NULL) is called, and libradio_wait() returns
+ * LIBRADIO_WAIT_SPI. Note that done() is called from the SPI interrupt,
+ * so it should be brief. It can queue another transaction with
+ * pkt_submit(), but it mustn't wait for one.
+ */
+struct pkt_xact	{
+	uchar_t		*buf;
+	uchar_t		send_len;
+	uchar_t		recv_len;
+	volatile uchar_t	status;
+	void		(*done)(struct pkt_xact *);
+};
+
+/*
+ * Per-command CTS wait statistics. Times are in Timer1 counts.
+ */
+struct cts_stat	{
+	uchar_t		cmd;
+	uint_t		count;
+	uint_t		max;
+	unsigned long	total;
+};
+
+/*
+ * An entry in the command trace ring (LIBRADIO_TRACE). The command byte,
+ * the result code, the number of CTS polls (or clock ticks spent waiting
+ * for hardware CTS), when the transaction started (the low byte of
+ * all_ticks, and TCNT1) and how long it took, in Timer1 counts.
+ */
+#ifdef LIBRADIO_TRACE
+#ifndef LIBRADIO_TRACE_DEPTH
+#define LIBRADIO_TRACE_DEPTH		16
+#endif
+
+struct trace	{
+	uchar_t		cmd;
+	uchar_t		status;
+	uchar_t		polls;
+	uchar_t		tick;
+	uint_t		stamp;
+	uint_t		elapsed;
+};
+#endif
+
+/*
+ * State timeouts, in milliseconds. A client listens for a minute (two
+ * if it has been WARM) before giving up, and an active client which
+ * hears nothing for half an hour goes back to sleep. A WARM sleep lasts
+ * five minutes and a COLD one an hour.
+ */
+#define LIBRADIO_LISTEN_TIMEOUT		60000L
+#define LIBRADIO_ACTIVE_TIMEOUT		1800000L
+#define LIBRADIO_WARM_TIMEOUT		300000L
+#define LIBRADIO_COLD_TIMEOUT		3600000L
+
+/*
+ * Fragment reassembly (see frag.c). The number of messages (from
+ * different nodes) which can be put back together at once, and how
+ * long (in ms) to wait for the rest of a message before giving up.
+ */
+#ifndef LIBRADIO_FRAG_BUFS
+#define LIBRADIO_FRAG_BUFS			2
+#endif
+#define LIBRADIO_FRAG_TIMEOUT		2000L
+
+/*
+ * Firmware updates (see ota.c). The new image is staged in the top
+ * half of the application flash, so neither the running code nor the
+ * new image can be bigger than OTA_STAGE_BASE bytes (lib/ota.ld checks
+ * this at link time). While the image is being installed, the "install
+ * pending" flag and the number of pages are kept in the two bytes of
+ * EEPROM below the drift data. The staging address and the flag are
+ * also in flash.S.
+ */
+#define OTA_STAGE_BASE				0x3f00
+#define OTA_MAX_PAGES				(OTA_STAGE_BASE / OTA_PAGE_SIZE)
+#define OTA_ALL_CHUNKS				((1UL << OTA_NCHUNKS) - 1)
+#define OTA_PENDING					0xa5
+#ifndef LIBRADIO_OTA_EEPROM
+#define LIBRADIO_OTA_EEPROM			(E2END - 5)
+#endif
+
+/*
+ * Depth of the RX packet queue (see handle.c). Can be overridden at
+ * build time.
+ */
+#ifndef LIBRADIO_RXQ_DEPTH
+#define LIBRADIO_RXQ_DEPTH			4
+#endif
+
+/*
+ * Transmit states (radio.tx_state). SENDING means a frame is on its way
+ * and we're waiting for the PACKET_SENT interrupt. RESPOND is the same,
+ * but the radio should go back to receiving on our channel afterwards.
+ */
+#define LIBRADIO_TX_IDLE			0
+#define LIBRADIO_TX_SENDING			1
+#define LIBRADIO_TX_RESPOND			2
+
+/*
+ * Per-channel link statistics, indexed by the radio channel number.
+ * Channels above LIBRADIO_NCHANNELS are not counted.
+ */
+#define LIBRADIO_NCHANNELS	8
+
+struct chstats	{
+	uint_t		crc_errors;
+#ifdef LIBRADIO_CSMA
+	uint_t		cca_busy;		/* Channel found busy */
+	uint_t		backoff;		/* Clock ticks spent backing off */
+	uint_t		deferred;		/* Sends refused during a backoff */
+#endif
+};
+
+/*
+ * Link-wide counters, kept as 32-bit values so that they don't wrap on
+ * a busy controller. They are reported two at a time in the status
+ * blocks RADIO_STATUS_LINK to RADIO_STATUS_LINK + 5. The LINK_REL_
+ * counters are only used with LIBRADIO_RELIABLE.
+ */
+#define LINK_RX_GOOD		0		/* Packets received */
+#define LINK_RX_BAD			1		/* Bad checksum or CRC */
+#define LINK_RX_OVERFLOW	2		/* RX FIFO found full */
+#define LINK_CTS_TIMEOUT	3		/* SPI_SEND_TIMEOUT */
+#define LINK_TX_NOTREADY	4		/* TX refused, radio not READY */
+#define LINK_TX_FULL		5		/* TX refused, TX FIFO full */
+#define LINK_IRQS			6		/* Radio IRQs serviced */
+#define LINK_STATE_CHANGES	7		/* libradio_set_state() transitions */
+#define LINK_REL_DELIVERED	8		/* Reliable packets ACKed (controller) */
+#define LINK_REL_RETRIES	9		/* Reliable packets sent again */
+#define LINK_REL_FAILED		10		/* Reliable packets never ACKed */
+#define LINK_REL_DUPS		11		/* Duplicate packets dropped (client) */
+#define LIBRADIO_NLINK		12
+
+/*
+ * Listen-before-talk parameters. The default busy threshold of 80 is
+ * about -90dBm. The backoff window doubles each time the channel is
+ * found busy, up to 2^CSMA_MAX_TRIES clock ticks. After tuning, the
+ * RSSI is given CSMA_RSSI_SETTLE Timer1 counts (4us each) to settle.
+ */
+#define CSMA_THRESHOLD		80
+#define CSMA_MAX_TRIES		5
+#define CSMA_TUNE_POLLS		20
+#define CSMA_RSSI_SETTLE	64
 
 /*
  * Main status. Here is where the various status parameters exchanged with
@@ -107,8 +378,8 @@
  * period - No. of 10ms ticks per interrupt (see slow/fast)
  * heart_beat - Timer used for the LED song
  * date - Current date (user-defined)
- * timeout - How long to go from WARM to COLD
  * all_ticks - No. of clock ticks since boot
+ * uptime - Milliseconds since boot (monotonic, whatever the clock speed)
  * main_ticks - When waiting for stuff to happen, set this to the number
  *   of clock ticks (at whatever clock frequency) to be the wakeup. Used
  *   by libradio_tick_wait() to figure out if the main_ticks clock has
@@ -120,6 +391,7 @@
  * my_channel - My channel number. Zero is the sleepy channel 
  * curr_channel - Current channel
  * my_node_id - My NodeID. Zero means "unset"
+ * last_seq - Sequence number of the last reliable packet we accepted
  * cat1, cat2 - Two category bytes (see README) 
  * num1,  num2 - Two instance bytes (see README)
  *
@@ -139,6 +411,9 @@
  * npacket_tx - No. of packets transmitted
  * curr_state - Current state
  * radio_active - Radio active
+ * radio_asleep - Radio put into SLEEP by libradio_power_down()
+ * sniffing - Radio is in low duty cycle receive (LIBRADIO_SNIFF)
+ * tx_state - Transmit state machine: LIBRADIO_TX_{x}
  * rx_fifo - RX fifo count
  * tx_fifo - TX fifo count
  * int_pending - interrupt-pending status
@@ -151,6 +426,16 @@
  * chip_status - chip interrupt status
  * cmd_error - command error
  * saw_rx - Saw an RX packet (boolean)
+ *
+ * rxq_max - Most packets seen in the RX queue at once
+ * rxq_overflow - No. of packets dropped because the RX queue was full
+ * frag_lost - No. of fragmented messages which were never completed
+ * time_error - Network time error on the last time sync (Timer1 counts)
+ * time_nsync - No. of precise time syncs
+ * time_maxerr - Largest time error seen
+ * time_drift - Estimated clock drift, in 0.01ppm (positive is fast)
+ * link - Link-wide 32-bit counters (see LINK_{x} above)
+ * chstats - Per-channel link statistics (CRC failures, CSMA, etc)
  */
 struct libradio {
 	/*
@@ -164,8 +449,8 @@ struct libradio {
 	uchar_t		period;
 	uint_t		heart_beat;
 	uint_t		date;
-	uint_t		timeout;
 	uint_t		all_ticks;
+	unsigned long	uptime;
 	uint_t		main_ticks;
 	uint_t		tick_count;
 	uchar_t		catch_irq;
@@ -175,6 +460,7 @@ struct libradio {
 	uchar_t		my_channel;
 	uchar_t		curr_channel;
 	uchar_t		my_node_id;
+	uchar_t		last_seq;
 	uchar_t		cat1, cat2;
 	uchar_t		num1, num2;
 	/*
@@ -198,6 +484,9 @@ struct libradio {
 	uint_t		npacket_tx;
 	uchar_t		curr_state;
 	uchar_t		radio_active;
+	uchar_t		radio_asleep;
+	uchar_t		sniffing;
+	uchar_t		tx_state;
 	uchar_t		rx_fifo;
 	uchar_t		tx_fifo;
 	uchar_t		int_pending;
@@ -214,21 +503,99 @@ struct libradio {
 	uchar_t		latch_rssi;
 	uchar_t		ant1_rssi;
 	uchar_t		ant2_rssi;
+	/*
+	 * Link statistics.
+	 */
+	uchar_t		rxq_max;
+	uint_t		rxq_overflow;
+	uint_t		frag_lost;
+	int			time_error;
+	uint_t		time_nsync;
+	uint_t		time_maxerr;
+	int			time_drift;
+	unsigned long	link[LIBRADIO_NLINK];
+	struct chstats	chstats[LIBRADIO_NCHANNELS];
 };
 
 extern uchar_t			pkt_data[MAX_SPI_BLOCK];
+extern volatile uchar_t	pkt_done;
+extern volatile uchar_t	event_posted;
+extern uint_t			pkt_count;
+extern uchar_t			pkt_rxlen;
+extern uchar_t			pkt_rxflen;
+extern uint_t			irq_ticks;
+extern uint_t			irq_tcnt;
+extern uchar_t			irq_stamped;
+#ifdef LIBRADIO_DRIFT
+extern long				slew_steps;
+#endif
 extern struct libradio	radio;
+extern const uchar_t	radio_config[];
 
 /*
  *
  */
 void	pkt_init();
 uchar_t	pkt_send(uchar_t, uchar_t);
-uchar_t	libradio_rxpacket(struct channel *chp);
-uchar_t	libradio_txpacket(struct channel *);
+uchar_t	pkt_submit(struct pkt_xact *);
+void	pkt_flush();
+void	pkt_burst(uchar_t);
+void	pkt_burst_end();
+void	pkt_intr();
+void	pkt_cts();
+void	pkt_cts_enable(uchar_t);
+void	pkt_tick();
+uchar_t	pkt_busy();
+void	clock_credit();
+void	clock_sync();
+void	clock_reschedule();
+void	clock_wake(uint_t);
+uint_t	clock_counts(uint_t *);
+uint_t	clock_tick_counts();
+void	pkt_cts_stats(uchar_t);
+void	pkt_spi_stats(uchar_t);
+void	pkt_trace_stats(uchar_t);
+int		pkt_trace_status(uchar_t [], int);
+uchar_t	libradio_rxburst(struct channel [], uchar_t, uchar_t);
+uchar_t	pkt_read_frame(struct channel *, uchar_t *);
+uchar_t	pkt_rxcheck(struct channel *);
+uchar_t	libradio_txpacket(struct channel *, uchar_t *);
+uchar_t	pkt_txprep(struct channel *);
+void	pkt_timesync(struct packet *);
+void	libradio_time_stats(uchar_t);
+void	drift_init();
+void	drift_update(long, int);
+void	radio_stamp();
 uchar_t	pkt_error(uchar_t);
+uchar_t	libradio_crc_good(uchar_t);
+void	libradio_crc_error();
+uchar_t	libradio_tx_intr();
+void	rxq_service();
+void	libradio_rxq_stats(uchar_t);
+void	libradio_event_stats(uchar_t);
+void	libradio_tx_flush();
+void	libradio_tx_finish();
+int		power_resume();
+void	hop_init();
+void	prop_init();
+void	libradio_set_preamble(uchar_t);
+uchar_t	libradio_cca(uchar_t);
+uchar_t	csma_expired(uchar_t);
+void	csma_settle();
+void	csma_wait(uchar_t);
+void	libradio_csma_stats(uchar_t);
+void	libradio_crc_count();
+void	libradio_crc_stats(uchar_t);
 void	libradio_set_song(uchar_t);
 void	libradio_command(struct packet *);
 void	libradio_send_response(uchar_t, uchar_t, uchar_t, uchar_t, uchar_t []);
+uchar_t	rel_check(struct packet *);
+void	frag_send(uchar_t, uchar_t, uchar_t, uchar_t, uchar_t []);
+void	ota_command(struct packet *);
+int		ota_status(uchar_t [], int);
+void	libradio_ota_stats(uchar_t);
 
 void	_setss(uchar_t);
+void	_snooze();
+void	_flash_page(uint_t, uchar_t *);
+void	_flash_copy(uchar_t);
@@ -55,11 +55,34 @@ libradio_rxloop()
 	 * into doing something. The funcion returns on an RX IRQ,
 	 * an SIO IRQ or a timeout.
 	 */
-	if (libradio_wait() & LIBRADIO_WAIT_RXINT) {
+	libradio_rxevent(libradio_wait());
+}
+
+/*
+ * The work of libradio_rxloop(), given the libradio_wait() status. This
+ * is also the radio handler for the event scheduler (see event.c), where
+ * it should be registered in slot 0 with LIBRADIO_WAIT_ALL, as the state
+ * machine needs to run whenever we wake up.
+ */
+void
+libradio_rxevent(uchar_t status)
+{
+	if (status & LIBRADIO_WAIT_RXINT) {
 		libradio_set_delay(5);
-		libradio_handle_packet();
-		libradio_get_int_status();
-		libradio_irq_enable(1);
+		/*
+		 * Empty the radio FIFO into the RX queue, and then run the
+		 * commands.
+		 */
+		rxq_service();
+		libradio_dispatch();
+#ifdef LIBRADIO_SNIFF
+		/*
+		 * A sniff heard something. Wake up properly and listen for
+		 * an activation.
+		 */
+		if (radio.state == LIBRADIO_STATE_COLD || radio.state == LIBRADIO_STATE_WARM)
+			libradio_set_state(LIBRADIO_STATE_LISTEN);
+#endif
 	}
 	/*
 	 * Depending on what state we're in, do something useful. For a lot of
@@ -75,24 +98,33 @@ libradio_rxloop()
 		break;
 
 	case LIBRADIO_STATE_STARTUP:
+		libradio_set_state(LIBRADIO_STATE_LISTEN);
+		break;
+
 	case LIBRADIO_STATE_COLD:
 	case LIBRADIO_STATE_WARM:
 		/*
-		 * Time to wake up and check for radio traffic.
+		 * Time to wake up and check for radio traffic? Only if the
+		 * sleep is over (or the radio heard something). Anything else,
+		 * such as an application timer, goes back to sleep for the
+		 * rest of it. The radio was put to sleep, so wake it up and
+		 * start listening again.
 		 */
+		if ((status & LIBRADIO_WAIT_RXINT) == 0 &&
+						!libradio_timer_expired(LIBRADIO_TIMER_STATE))
+			break;
 		libradio_set_state(LIBRADIO_STATE_LISTEN);
+		libradio_recv_start();
 		break;
 
 	case LIBRADIO_STATE_LISTEN:
-#if 0
-		if (--radio.timeout == 0) {
+		if (libradio_timer_expired(LIBRADIO_TIMER_STATE)) {
 			/*
 			 * If we're still in this state after the timeout, then we go to
 			 * WARM or COLD sleep depending on whether we've seen any traffic.
 			 */
 			libradio_set_state(radio.saw_rx ? LIBRADIO_STATE_WARM : LIBRADIO_STATE_COLD);
 		}
-#endif
 		break;
 
 	default:
@@ -100,10 +132,10 @@ libradio_rxloop()
 		 * Any active state - check for radio traffic.
 		 */
 		if (radio.saw_rx) {
-			radio.timeout = 60000;
+			libradio_timer_arm(LIBRADIO_TIMER_STATE, LIBRADIO_ACTIVE_TIMEOUT);
 			radio.saw_rx = 0;
 		}
-		if (--radio.timeout == 0) {
+		if (libradio_timer_expired(LIBRADIO_TIMER_STATE)) {
 			/*
 			 * Haven't seen any traffic in a *long* time.
 			 */
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Over-the-air firmware updates (LIBRADIO_OTA). The controller
+ * broadcasts the new image a flash page at a time, so one transmission
+ * updates every client of a category at once, however many there are.
+ * A RADIO_OTA_BEGIN names the category, the number of pages and the
+ * CRC of the whole image. Clients of any other category ignore the
+ * rest. Each page is sent as a window of RADIO_OTA_DATA chunks, which
+ * are collected in a page buffer, followed by a RADIO_OTA_COMMIT with
+ * the CRC of the page. If we have all of it and the CRC is good, the
+ * page is written to the staging area in the top half of the flash.
+ * Otherwise we keep what we have and wait to be sent the rest.
+ *
+ * Lost chunks are found by asking each client for status block
+ * RADIO_STATUS_OTA, which says how many pages it has, the first page
+ * it still needs, and which chunks of that page are missing. Only
+ * those chunks (or pages) need to be sent again. Once every page is in,
+ * the CRC of the staged image is checked, and a RADIO_OTA_FINISH then
+ * copies it over the application and restarts (see flash.S). An
+ * "install pending" flag is set in the EEPROM first, so that if the
+ * power goes part way through the copy, the boot section finishes it
+ * on the next reset. The time from BEGIN to having the whole image is
+ * kept, as the time-to-update.
+ *
+ * All CRCs are CRC-16/CCITT as computed by _crc_ccitt_update(), starting
+ * from 0xffff.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+
+#ifdef LIBRADIO_OTA
+#if defined(SPM_PAGESIZE) && SPM_PAGESIZE != OTA_PAGE_SIZE
+#error "OTA_PAGE_SIZE doesn't match the flash page size"
+#endif
+
+/*
+ * The update in progress. The state (RADIO_OTA_{x}), the number of
+ * pages in the image and its CRC, a bitmap of the pages we've written,
+ * the page in the buffer and a bitmap of the chunks we have for it.
+ */
+struct ota	{
+	uchar_t			state;
+	uchar_t			npages;
+	uint_t			crc;
+	uchar_t			ndone;
+	uchar_t			done[(OTA_MAX_PAGES + 7) / 8];
+	uchar_t			page;
+	unsigned long	have;
+	unsigned long	start;
+	unsigned long	elapsed;
+	uint_t			chunks;
+	uint_t			dups;
+	uint_t			crc_errors;
+	uint_t			dropped;
+	uchar_t			buffer[OTA_PAGE_SIZE];
+};
+
+struct ota	ota;
+
+extern uchar_t	__data_load_end[];
+
+void	ota_begin(struct packet *);
+void	ota_data(struct packet *);
+void	ota_commit(struct packet *);
+void	ota_finish(struct packet *);
+void	ota_verify();
+uchar_t	ota_want();
+
+#define OTA_DONE(p)		(ota.done[(p) >> 3] & (1 << ((p) & 07)))
+
+/*
+ * Handle a RADIO_CMD_FIRMWARE packet.
+ */
+void
+ota_command(struct packet *pp)
+{
+	if (pp->len < 1)
+		return;
+	switch (pp->data[0] & RADIO_OTA_OP_MASK) {
+	case RADIO_OTA_BEGIN:
+		ota_begin(pp);
+		break;
+
+	case RADIO_OTA_DATA:
+		ota_data(pp);
+		break;
+
+	case RADIO_OTA_COMMIT:
+		ota_commit(pp);
+		break;
+
+	case RADIO_OTA_FINISH:
+		ota_finish(pp);
+		break;
+
+	case RADIO_OTA_ABORT:
+		if (pp->len == 1)
+			ota.state = RADIO_OTA_IDLE;
+		break;
+	}
+}
+
+/*
+ * Start a new update, if it's for our category. Anything we had from an
+ * earlier one is forgotten. If the running code reaches into the staging
+ * area (which the link should have caught), the update is refused, as
+ * staging the image would overwrite it.
+ */
+void
+ota_begin(struct packet *pp)
+{
+	uchar_t i;
+
+	if (pp->len != 6 || pp->data[0] != RADIO_OTA_BEGIN)
+		return;
+	ota.state = RADIO_OTA_IDLE;
+	if (pp->data[1] != radio.cat1 || pp->data[2] != radio.cat2)
+		return;
+	if (pp->data[3] == 0 || pp->data[3] > OTA_MAX_PAGES)
+		return;
+	if ((uint_t )__data_load_end > OTA_STAGE_BASE) {
+		printf(">> OTA refused, image too big\n");
+		return;
+	}
+	ota.npages = pp->data[3];
+	ota.crc = (pp->data[4] << 8 | pp->data[5]);
+	ota.ndone = 0;
+	for (i = 0; i < sizeof(ota.done); i++)
+		ota.done[i] = 0;
+	ota.have = 0;
+	ota.start = libradio_uptime();
+	ota.elapsed = 0;
+	ota.chunks = ota.dups = ota.crc_errors = ota.dropped = 0;
+	ota.state = RADIO_OTA_LOADING;
+	printf(">> OTA %d pages, CRC %x\n", ota.npages, ota.crc);
+}
+
+/*
+ * A chunk of a page. Chunks of pages we've already written are just
+ * counted. A chunk of a different page means the one in the buffer
+ * has been given up on, for now.
+ */
+void
+ota_data(struct packet *pp)
+{
+	uchar_t i, chunk, page, off, n;
+
+	if (ota.state != RADIO_OTA_LOADING || pp->len <= OTA_HEADER_LEN)
+		return;
+	chunk = pp->data[0] & RADIO_OTA_CHUNK_MASK;
+	if (chunk >= OTA_NCHUNKS || (page = pp->data[1]) >= ota.npages)
+		return;
+	off = chunk * OTA_CHUNK;
+	if ((n = OTA_PAGE_SIZE - off) > OTA_CHUNK)
+		n = OTA_CHUNK;
+	if (pp->len != n + OTA_HEADER_LEN)
+		return;
+	if (OTA_DONE(page) || (page == ota.page && (ota.have & (1UL << chunk)))) {
+		ota.dups++;
+		return;
+	}
+	if (page != ota.page) {
+		if (ota.have != 0)
+			ota.dropped++;
+		ota.page = page;
+		ota.have = 0;
+	}
+	for (i = 0; i < n; i++)
+		ota.buffer[off + i] = pp->data[OTA_HEADER_LEN + i];
+	ota.have |= (1UL << chunk);
+	ota.chunks++;
+}
+
+/*
+ * The end of a page. If we have all of it, check the CRC and write it
+ * to the staging area. A bad page has to be sent again in full.
+ */
+void
+ota_commit(struct packet *pp)
+{
+	uchar_t i, page;
+	uint_t crc = 0xffff;
+
+	if (ota.state != RADIO_OTA_LOADING || pp->len != 4)
+		return;
+	page = pp->data[1];
+	if (page >= ota.npages || OTA_DONE(page))
+		return;
+	if (page != ota.page || ota.have != OTA_ALL_CHUNKS)
+		return;
+	for (i = 0; i < OTA_PAGE_SIZE; i++)
+		crc = _crc_ccitt_update(crc, ota.buffer[i]);
+	ota.have = 0;
+	if (crc != (pp->data[2] << 8 | pp->data[3])) {
+		ota.crc_errors++;
+		return;
+	}
+	_flash_page(OTA_STAGE_BASE + page * OTA_PAGE_SIZE, ota.buffer);
+	ota.done[page >> 3] |= (1 << (page & 07));
+	if (++ota.ndone == ota.npages)
+		ota_verify();
+}
+
+/*
+ * We have every page. Check the CRC of the staged image, as read back
+ * from the flash.
+ */
+void
+ota_verify()
+{
+	uint_t i, crc = 0xffff;
+
+	for (i = 0; i < ota.npages * OTA_PAGE_SIZE; i++)
+		crc = _crc_ccitt_update(crc, pgm_read_byte(OTA_STAGE_BASE + i));
+	ota.elapsed = libradio_uptime() - ota.start;
+	ota.state = (crc == ota.crc) ? RADIO_OTA_READY : RADIO_OTA_FAILED;
+	printf(">> OTA %s (%lums)\n", ota.state == RADIO_OTA_READY ? "ready" : "FAILED", ota.elapsed);
+}
+
+/*
+ * Install the new image and restart. The CRC has to match the one we
+ * were given at the start, so that a stray FINISH for some other update
+ * can't do any harm. The install pending flag goes in after the page
+ * count, so a reset between the two writes leaves the old code alone.
+ */
+void
+ota_finish(struct packet *pp)
+{
+	if (ota.state != RADIO_OTA_READY || pp->len != 3)
+		return;
+	if (ota.crc != (pp->data[1] << 8 | pp->data[2]))
+		return;
+	printf(">> OTA install\n");
+	eeprom_update_byte((uchar_t *)(LIBRADIO_OTA_EEPROM + 1), ota.npages);
+	eeprom_update_byte((uchar_t *)LIBRADIO_OTA_EEPROM, OTA_PENDING);
+	eeprom_busy_wait();
+	_flash_copy(ota.npages);
+}
+
+/*
+ * Return the first page we still need (or npages, if we have them all).
+ */
+uchar_t
+ota_want()
+{
+	uchar_t page;
+
+	for (page = 0; page < ota.npages && OTA_DONE(page); page++)
+		;
+	return(page);
+}
+
+/*
+ * Fill in status block RADIO_STATUS_OTA. The status type, the update
+ * state, the number of pages written, the first page we still need, a
+ * bitmap of the chunks of that page which are missing (four bytes, most
+ * significant first) and the time-to-update in tenths of a second (so
+ * far, if we're still loading). Returns the number of bytes used.
+ */
+int
+ota_status(uchar_t status[], int maxlen)
+{
+	uchar_t want;
+	unsigned long missing, elapsed;
+
+	if (maxlen < 10)
+		return(0);
+	want = ota_want();
+	missing = 0;
+	if (ota.state == RADIO_OTA_LOADING && want < ota.npages)
+		missing = (want == ota.page) ? (OTA_ALL_CHUNKS & ~ota.have) : OTA_ALL_CHUNKS;
+	if ((elapsed = ota.elapsed) == 0 && ota.state == RADIO_OTA_LOADING)
+		elapsed = libradio_uptime() - ota.start;
+	elapsed /= 100;
+	if (elapsed > 0xffff)
+		elapsed = 0xffff;
+	status[0] = RADIO_STATUS_OTA;
+	status[1] = ota.state;
+	status[2] = ota.ndone;
+	status[3] = want;
+	status[4] = (missing >> 24) & 0xff;
+	status[5] = (missing >> 16) & 0xff;
+	status[6] = (missing >> 8) & 0xff;
+	status[7] = missing & 0xff;
+	status[8] = (elapsed >> 8) & 0xff;
+	status[9] = elapsed & 0xff;
+	return(10);
+}
+
+/*
+ * Print the update statistics. The state, pages written out of the
+ * total, chunks received, duplicates, pages which failed the CRC check,
+ * partial pages given up on, and the time-to-update in ms.
+ */
+void
+libradio_ota_stats(uchar_t clear)
+{
+	printf("OTA:S%d,P%d/%d,W%d,C%u,D%u,E%u,L%u,T%lu\n", ota.state,
+				ota.ndone, ota.npages, ota_want(), ota.chunks,
+				ota.dups, ota.crc_errors, ota.dropped, ota.elapsed);
+	if (clear)
+		ota.chunks = ota.dups = ota.crc_errors = ota.dropped = 0;
+}
+#endif
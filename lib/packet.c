@@ -30,9 +30,27 @@
  *
  * ABSTRACT
  * This is where the low-level serial peripheral interface (SPI) activity
- * takes place. Functions to read and write a byte over the SPI port are
- * contained in here, and in the low-level _setss() function. Eventually
- * this stuff will operate via interrupts, but for now it is polled.
+ * takes place. Radio commands are queued up as transactions and clocked
+ * out to the radio under the control of the SPI transfer-complete
+ * interrupt (see spi_irq.S). Each transaction sends a command, polls
+ * for CTS (clear-to-send) and reads back the response, one byte per
+ * interrupt. The synchronous pkt_send() function sits on top of this,
+ * and sleeps the CPU between bytes rather than spinning on the SPI
+ * status register. The FIFO read/write functions still talk to the SPI
+ * port directly, once the transaction queue has drained. With
+ * LIBRADIO_VARLEN, frames in the FIFO are preceded by a length byte
+ * rather than being padded out to SI4463_PACKET_LEN, and a frame can
+ * carry more than one packet.
+ *
+ * If the library is built with LIBRADIO_HW_CTS, radio GPIO3 is configured
+ * as a CTS output and wired to PB0. Rather than polling over SPI, we wait
+ * for the pin-change interrupt (see cts_irq.S) and only go back to the
+ * radio if there's a response to read. Either way, the time spent waiting
+ * for CTS is recorded per command, in units of Timer1 counts.
+ *
+ * With LIBRADIO_TRACE, every transaction (and every direct FIFO or FRR
+ * transfer) is also logged in a small ring, which can be dumped on the
+ * console or read back over the air as a RADIO_STATUS_TRACE status block.
  */
 #include <stdio.h>
 #include <avr/io.h>
@@ -42,12 +60,53 @@
 #include "internal.h"
 
 #define MAX_COUNT		1000
+#define MAX_CTS_TICKS		25
+#define PKT_QUEUE_LEN		4
+#define NCTS_STATS		8
+
+/*
+ * States for the transaction engine.
+ */
+#define PKT_IDLE		0
+#define PKT_SEND		1
+#define PKT_CTSCMD		2
+#define PKT_CTS			3
+#define PKT_RECV		4
+#define PKT_CTSWAIT		5
+
+volatile uchar_t	pkt_state;
+volatile uchar_t	pkt_done;
+uchar_t			pkt_index;
+uint_t			pkt_polls;
+uint_t			pkt_count;
+uint_t			pkt_npolls;
+uchar_t			pkt_hwcts;
+uint_t			pkt_stamp;
+uint_t			pkt_stamp_ticks;
+uchar_t			pkt_head;
+uchar_t			pkt_tail;
+uchar_t			pkt_rxlen;
+uchar_t			pkt_rxflen;
+uchar_t			pkt_data[MAX_SPI_BLOCK];
+struct pkt_xact		*pkt_q[PKT_QUEUE_LEN];
+struct pkt_xact		pkt_sync;
+struct cts_stat		cts_stats[NCTS_STATS];
+#ifdef LIBRADIO_TRACE
+struct trace		trace[LIBRADIO_TRACE_DEPTH];
+uchar_t			trace_head;
+uchar_t			trace_count;
+uchar_t			trace_unsent;
+uchar_t			trace_cmd;
+uint_t			trace_ticks;
+uint_t			trace_stamp;
+#endif
 
-uchar_t		pkt_state;
-uchar_t		pkt_index;
-uchar_t		pkt_send_len;
-uchar_t		pkt_recv_len;
-uchar_t		pkt_data[MAX_SPI_BLOCK];
+void	pkt_start();
+void	pkt_finish(uchar_t);
+void	pkt_cts_done();
+#ifdef LIBRADIO_TRACE
+void	trace_record(uchar_t);
+#endif
 
 /*
  * Initialize the SPI circuit in the Atmel chip. We are running at a speed
@@ -56,7 +115,8 @@ uchar_t		pkt_data[MAX_SPI_BLOCK];
 void
 pkt_init()
 {
-	pkt_index = pkt_send_len = pkt_recv_len = 0;
+	pkt_state = PKT_IDLE;
+	pkt_index = pkt_head = pkt_tail = pkt_done = pkt_hwcts = 0;
 	spi_init();
 }
 
@@ -65,99 +125,507 @@ pkt_init()
  * buffer) and retrieve a sequence (recv_len) of bytes in response. This
  * can be used to write data (for example to the FIFO), to exchange data
  * (such as sending a command), and to read data (for example, reading
- * from the RX FIFO). For every byte we send, we get one back.
+ * from the RX FIFO). For every byte we send, we get one back. This is
+ * a synchronous call, so we queue the transaction and then sleep until
+ * the interrupt handler has finished with it.
  */
 uchar_t
 pkt_send(uchar_t send_len, uchar_t recv_len)
 {
-	int i, j, k;
+	pkt_flush();
+	pkt_sync.buf = pkt_data;
+	pkt_sync.send_len = send_len;
+	pkt_sync.recv_len = recv_len;
+	pkt_sync.done = NULL;
+	if (pkt_submit(&pkt_sync) == 0)
+		return(SPI_SEND_WRITE_FAIL);
+	pkt_flush();
+	return(pkt_sync.status);
+}
 
-	/*
-	 * Do this piece with the SLAVE_SELECT (SS) bit enabled.
-	 */
-	_setss(1);
-	for (i = 0; i < send_len; i++) {
-		if (spi_byte(pkt_data[i]) == -1) {
-			_setss(0);
-			return(SPI_SEND_WRITE_FAIL);
-		}
+/*
+ * Add a transaction to the queue. If the engine is idle, kick it off.
+ * The CTS timeout is counted in clock ticks, so in tickless mode the
+ * next Timer1 compare has to be pulled in to the next tick (see
+ * clock_next()). Returns zero if the queue is full. The interrupt flag
+ * is put back the way it was, so this can be called from a done()
+ * callback.
+ */
+uchar_t
+pkt_submit(struct pkt_xact *xp)
+{
+	uchar_t next, sreg = SREG;
+
+	if (xp->send_len == 0 || xp->recv_len > MAX_SPI_BLOCK)
+		return(0);
+	cli();
+	if ((next = (pkt_tail + 1) % PKT_QUEUE_LEN) == pkt_head) {
+		SREG = sreg;
+		return(0);
+	}
+	xp->status = SPI_SEND_BUSY;
+	pkt_q[pkt_tail] = xp;
+	pkt_tail = next;
+	if (pkt_state == PKT_IDLE) {
+		pkt_start();
+		clock_reschedule();
 	}
+	SREG = sreg;
+	return(1);
+}
+
+/*
+ * Wait for all queued transactions to complete. We sleep in between
+ * interrupts. The sleep instruction is executed atomically with the
+ * re-enabling of interrupts (see snooze.S) so we can't miss the final
+ * SPI interrupt.
+ */
+void
+pkt_flush()
+{
+	uchar_t sreg = SREG;
+
+	cli();
+	while (pkt_state != PKT_IDLE)
+		_snooze();
+	SREG = sreg;
+}
+
+/*
+ * Start the transaction at the head of the queue. Called with
+ * interrupts disabled.
+ */
+void
+pkt_start()
+{
+	struct pkt_xact *xp = pkt_q[pkt_head];
+
+	pkt_index = 0;
+	pkt_polls = 0;
+	pkt_count++;
+#ifdef LIBRADIO_TRACE
+	trace_cmd = xp->buf[0];
+	trace_stamp = clock_counts(&trace_ticks);
+#endif
+	pkt_state = PKT_SEND;
+	SPCR |= (1<<SPIE);
+	_setss(1);
+	SPDR = xp->buf[0];
+}
+
+/*
+ * The current transaction is complete. Record the status, notify
+ * whoever is interested, and move on to the next one (if any).
+ */
+void
+pkt_finish(uchar_t status)
+{
+	struct pkt_xact *xp = pkt_q[pkt_head];
+
 	_setss(0);
-	for (i = 0; i < MAX_COUNT; i++) {
+#ifdef LIBRADIO_TRACE
+	trace_record(status);
+#endif
+	if (status == SPI_SEND_TIMEOUT)
+		radio.link[LINK_CTS_TIMEOUT]++;
+	pkt_head = (pkt_head + 1) % PKT_QUEUE_LEN;
+	xp->status = status;
+	if (xp->done != NULL) {
+		/*
+		 * Asynchronous - let libradio_wait() know.
+		 */
+		pkt_done = 1;
+		(*xp->done)(xp);
+	}
+	if (pkt_head != pkt_tail)
+		pkt_start();
+	else {
+		SPCR &= ~(1<<SPIE);
+		pkt_state = PKT_IDLE;
+	}
+}
+
+/*
+ * Called from the SPI interrupt (see spi_irq.S) when a byte has been
+ * exchanged with the radio. Work out what to do next, based on where
+ * we are in the transaction. Once the command has been sent, we poll
+ * for CTS by sending a READ_CMD_BUFF command and checking the reply.
+ * When CTS is 0xff, the response bytes (if any) follow immediately.
+ */
+void
+pkt_intr()
+{
+	uchar_t k = SPDR;
+	struct pkt_xact *xp = pkt_q[pkt_head];
+
+	switch (pkt_state) {
+	case PKT_SEND:
+		if (++pkt_index < xp->send_len) {
+			SPDR = xp->buf[pkt_index];
+			break;
+		}
+		_setss(0);
+		pkt_stamp = clock_counts(&pkt_stamp_ticks);
+#ifdef LIBRADIO_HW_CTS
+		if (pkt_hwcts) {
+			/*
+			 * Wait for the CTS line to go high. It may
+			 * already have done so.
+			 */
+			pkt_state = PKT_CTSWAIT;
+			PCMSK0 |= (1<<PCINT0);
+			PCICR |= (1<<PCIE0);
+			pkt_cts();
+			break;
+		}
+#endif
 		/*
 		 * Start by sending a READ_CMD_BUFF command.
 		 */
+		pkt_state = PKT_CTSCMD;
 		_setss(1);
-		if (spi_byte(0x44) < 0) {
-			_setss(0);
-			return(SPI_SEND_STATUS_FAIL);
-		}
-		if ((k = spi_byte(0xff)) < 0) {
+		SPDR = SI4463_READ_CMD_BUFF;
+		break;
+
+	case PKT_CTSCMD:
+		pkt_npolls++;
+		pkt_state = PKT_CTS;
+		SPDR = 0xff;
+		break;
+
+	case PKT_CTS:
+		if (k != 0xff) {
+			/*
+			 * No CTS - try again.
+			 */
 			_setss(0);
-			return(SPI_SEND_ACK_FAIL);
-		}
-		if (k == 0xff) {
-			for (j = 0; j < recv_len; j++) {
-				if ((k = spi_byte(0xff)) < 0) {
-					_setss(0);
-					return(SPI_SEND_READ_FAIL);
-				}
-				pkt_data[j] = k;
+			if (++pkt_polls >= MAX_COUNT) {
+				pkt_finish(SPI_SEND_TIMEOUT);
+				break;
 			}
-			_setss(0);
+			pkt_state = PKT_CTSCMD;
+			_setss(1);
+			SPDR = SI4463_READ_CMD_BUFF;
 			break;
 		}
+		pkt_index = 0;
+		if (pkt_hwcts == 0)
+			pkt_cts_done();
+		if (xp->recv_len == 0) {
+			pkt_finish(SPI_SEND_OK);
+			break;
+		}
+		pkt_state = PKT_RECV;
+		SPDR = 0xff;
+		break;
+
+	case PKT_RECV:
+		xp->buf[pkt_index++] = k;
+		if (pkt_index < xp->recv_len)
+			SPDR = 0xff;
+		else
+			pkt_finish(SPI_SEND_OK);
+		break;
+	}
+}
+
+#ifdef LIBRADIO_HW_CTS
+/*
+ * Called from the pin-change interrupt (see cts_irq.S) and when we first
+ * start waiting. If the CTS line is high, the radio has finished with
+ * the command. If there's nothing to read back, we're done. Otherwise,
+ * issue a READ_CMD_BUFF to collect the response. It'll have CTS set.
+ */
+void
+pkt_cts()
+{
+	struct pkt_xact *xp = pkt_q[pkt_head];
+
+	if (pkt_state != PKT_CTSWAIT || (PINB & (1<<PB0)) == 0)
+		return;
+	PCMSK0 &= ~(1<<PCINT0);
+	pkt_cts_done();
+	if (xp->recv_len == 0) {
+		pkt_finish(SPI_SEND_OK);
+		return;
+	}
+	pkt_state = PKT_CTSCMD;
+	_setss(1);
+	SPDR = SI4463_READ_CMD_BUFF;
+}
+
+/*
+ * Enable the hardware CTS line. Until the radio GPIO configuration has
+ * been sent, the pin doesn't mean anything, so we poll over SPI.
+ */
+void
+pkt_cts_enable(uchar_t flag)
+{
+	pkt_hwcts = flag;
+}
+#endif
+
+/*
+ * Called from the clock interrupt. In hardware CTS mode, there's no
+ * polling to time out, so give up if the radio hasn't responded after
+ * MAX_CTS_TICKS clock ticks.
+ */
+void
+pkt_tick()
+{
+	if (pkt_state == PKT_IDLE)
+		return;
+#ifdef LIBRADIO_HW_CTS
+	if (pkt_state == PKT_CTSWAIT && ++pkt_polls >= MAX_CTS_TICKS) {
+		PCMSK0 &= ~(1<<PCINT0);
+		pkt_finish(SPI_SEND_TIMEOUT);
+	}
+#endif
+}
+
+/*
+ * Start a direct SPI transfer (a FIFO read or write, or an FRR read)
+ * once the transaction queue has drained. There's no CTS to wait for,
+ * so the caller clocks the rest of it out with spi_byte() and then
+ * calls pkt_burst_end().
+ */
+void
+pkt_burst(uchar_t cmd)
+{
+#ifdef LIBRADIO_TRACE
+	uchar_t sreg;
+#endif
+
+	pkt_flush();
+	pkt_count++;
+#ifdef LIBRADIO_TRACE
+	sreg = SREG;
+	cli();
+	trace_cmd = cmd;
+	pkt_polls = 0;
+	trace_stamp = clock_counts(&trace_ticks);
+	SREG = sreg;
+#endif
+	_setss(1);
+	spi_byte(cmd);
+}
+
+/*
+ * The direct transfer is over. Log it in the trace ring along with the
+ * queued transactions.
+ */
+void
+pkt_burst_end()
+{
+#ifdef LIBRADIO_TRACE
+	uchar_t sreg = SREG;
+#endif
+
+	_setss(0);
+#ifdef LIBRADIO_TRACE
+	cli();
+	trace_record(SPI_SEND_OK);
+	SREG = sreg;
+#endif
+}
+
+/*
+ * Is there an SPI transaction in progress?
+ */
+uchar_t
+pkt_busy()
+{
+	return(pkt_state != PKT_IDLE);
+}
+
+/*
+ * We've seen CTS. Work out how long we waited (in Timer1 counts) and
+ * add it to the stats for this command.
+ */
+void
+pkt_cts_done()
+{
+	uchar_t i, cmd = pkt_q[pkt_head]->buf[0];
+	uint_t ticks;
+	long delta;
+	struct cts_stat *csp;
+
+	delta = clock_counts(&ticks);
+	delta += (long )(ticks - pkt_stamp_ticks) * (long )clock_tick_counts() - (long )pkt_stamp;
+	if (delta < 0)
+		delta = 0;
+	for (i = 0, csp = cts_stats; i < NCTS_STATS; i++, csp++) {
+		if (csp->count == 0 || csp->cmd == cmd)
+			break;
+	}
+	if (i == NCTS_STATS)
+		return;
+	if (csp->count == 0) {
+		csp->cmd = cmd;
+		csp->total = csp->max = 0;
+	}
+	csp->count++;
+	csp->total += delta;
+	if (delta > csp->max)
+		csp->max = (delta > 65535L) ? 65535 : delta;
+}
+
+/*
+ * Print the CTS wait stats. For each command, show the number of times
+ * it was issued, and the average and maximum CTS wait in Timer1 counts
+ * (4us each, at the normal clock rate).
+ */
+void
+pkt_cts_stats(uchar_t clear)
+{
+	uchar_t i;
+	struct cts_stat *csp;
+
+	for (i = 0, csp = cts_stats; i < NCTS_STATS; i++, csp++) {
+		if (csp->count == 0)
+			break;
+		printf("CTS%x:N%u,A%lu,M%u\n", csp->cmd, csp->count,
+					csp->total / csp->count, csp->max);
+		if (clear)
+			csp->count = 0;
+	}
+}
+
+/*
+ * Print the SPI transaction stats. This is the number of SPI commands
+ * (including FRR reads and FIFO transfers) and the number of
+ * READ_CMD_BUFF polls used to wait for CTS.
+ */
+void
+pkt_spi_stats(uchar_t clear)
+{
+	printf("SPI:N%u,P%u\n", pkt_count, pkt_npolls);
+	if (clear)
+		pkt_count = pkt_npolls = 0;
+}
+
+/*
+ * Copy as many complete packets as will fit in chp[] (up to npackets)
+ * from the RX FIFO in a single SPI transaction. The caller tells us how
+ * many bytes are in the FIFO. As each packet is retrieved, validate the
+ * checksum and save the network time (see pkt_rxcheck()). The good ones
+ * are packed into the start of the chp[] array. Returns the number of
+ * good packets.
+ */
+uchar_t
+libradio_rxburst(struct channel chp[], uchar_t npackets, uchar_t avail)
+{
+	int i, n, ngood;
+
+	pkt_burst(SI4463_READ_RX_FIFO);
+	for (n = 0; n < npackets && pkt_read_frame(&chp[n], &avail); n++)
+		;
+	pkt_burst_end();
+	for (i = ngood = 0; i < n; i++) {
+		if (pkt_rxcheck(&chp[i]) == 0)
+			continue;
+		if (ngood != i)
+			chp[ngood].packet = chp[i].packet;
+		ngood++;
+	}
+	return(ngood);
+}
+
+/*
+ * Read one packet from the RX FIFO, in the middle of a READ_RX_FIFO
+ * burst. *availp is the number of bytes in the FIFO, and is updated
+ * as we go. In fixed-length mode, every frame is SI4463_PACKET_LEN
+ * bytes and holds one packet. In variable-length mode (LIBRADIO_VARLEN)
+ * the frame starts with a length byte and may hold several packets.
+ * pkt_rxlen tracks how much of the current frame is left in the FIFO.
+ * We don't start on a frame until all of it has arrived. Anything which
+ * won't fit in the packet structure is discarded. Returns zero if there
+ * wasn't a complete packet.
+ */
+uchar_t
+pkt_read_frame(struct channel *chp, uchar_t *availp)
+{
+	uchar_t i, len, *cp = (uchar_t *)&chp->packet;
+
+#ifdef LIBRADIO_VARLEN
+	if (pkt_rxlen == 0) {
+		if (*availp == 0)
+			return(0);
+		pkt_rxlen = pkt_rxflen = spi_byte(0x00);
+		*availp -= 1;
+	}
+	if (pkt_rxlen > *availp)
+		return(0);
+	if (pkt_rxlen < PACKET_HEADER_LEN) {
 		/*
-		 * No CTS - try again.
+		 * Junk at the end of the frame. Discard it.
 		 */
-		_setss(0);
+		for (; pkt_rxlen > 0; pkt_rxlen--, *availp -= 1)
+			spi_byte(0x00);
+		return(0);
+	}
+	for (i = 0; i < PACKET_HEADER_LEN; i++)
+		*cp++ = spi_byte(0x00);
+	pkt_rxlen -= PACKET_HEADER_LEN;
+	*availp -= PACKET_HEADER_LEN;
+	if ((len = chp->packet.len) > pkt_rxlen)
+		len = pkt_rxlen;
+	pkt_rxlen -= len;
+	*availp -= len;
+	for (i = 0; i < len; i++) {
+		if (i < MAX_PAYLOAD_SIZE)
+			*cp++ = spi_byte(0x00);
+		else
+			spi_byte(0x00);
 	}
-	return(i == MAX_COUNT ? SPI_SEND_TIMEOUT : SPI_SEND_OK);
+#else
+	if ((len = SI4463_PACKET_LEN) > *availp)
+		return(0);
+	*availp -= len;
+	for (i = 0; i < len; i++) {
+		if (i < sizeof(struct packet))
+			*cp++ = spi_byte(0x00);
+		else
+			spi_byte(0x00);
+	}
+#endif
+	return(1);
 }
 
 /*
- * Copy a channel packet from the RX FIFO. As the packet is retrieved,
- * validate the checksum, Note that we will overwrite the system clock
- * ticks (ms_ticks) during this function, so beware...
+ * Check the checksum of a received packet and save the system clock
+ * ticks. Returns zero if the packet is bad. With LIBRADIO_HWCRC, the
+ * radio has already dropped any frame with a bad CRC, so there is
+ * nothing to check.
  */
 uchar_t
-libradio_rxpacket(struct channel *chp)
+pkt_rxcheck(struct channel *chp)
 {
+#ifndef LIBRADIO_HWCRC
 	int i, len;
 	uchar_t *cp, csum;
+#endif
 
-	/*
-	 * Pull the entire packet from the RX FIFO
-	 */
-	if ((len = radio.rx_fifo) > sizeof(struct packet))
-		len = sizeof(struct packet);
-	_setss(1);
-	spi_byte(SI4463_READ_RX_FIFO);
-	for (i = 0, cp = (uchar_t *)&chp->packet; i < len; i++)
-		*cp++ = spi_byte(0x00);
-	_setss(0);
-	/*
-	 * Now, check the checksum and save the system clock ticks.
-	 */
 	if (chp->packet.len > MAX_PAYLOAD_SIZE)
 		chp->packet.len = MAX_PAYLOAD_SIZE;
+#ifndef LIBRADIO_HWCRC
 	len = PACKET_HEADER_LEN + chp->packet.len;
 	for (i = csum = 0, cp = (uchar_t *)&chp->packet; i < len; i++)
 		csum ^= *cp++;
 	/*
 	 * If the checksum is good, save the network time in clock ticks. If
-	 * it's bad, set the command to be a No-Op and store the bad CS for
-	 * posterity.
+	 * it's bad, count it against the channel and drop the packet.
 	 */
-	if (csum != 0x00)
+	if (csum != 0x00) {
+		libradio_crc_count();
 		return(0);
+	}
+#endif
 	if (chp->packet.cmd < RADIO_STATUS_RESPONSE) {
 		/*
 		 * Only accept time values from control
 		 */
-		cli();
-		radio.ms_ticks = chp->packet.ticks;
-		sei();
+		pkt_timesync(&chp->packet);
 	}
 	return(1);
 }
@@ -167,42 +635,95 @@ libradio_rxpacket(struct channel *chp)
  * the packet at the last possible moment so that it is as accurate
  * as possible. As it's a 16bit quantity, we do this with interrupts
  * disabled. Also, the packet checksum is computed at the same time.
+ * In variable-length mode, any packets chained on to this one are
+ * folded into the same frame, for as long as they fit in MAX_FIFO_SIZE.
+ * We stop after a packet which needs a response, as the radio will
+ * switch to RX once the frame has gone. With LIBRADIO_SNIFF, an
+ * activation always starts a new frame, as only the first packet
+ * decides whether the frame gets the long preamble. Returns the number
+ * of packets loaded, and the frame length in *lenp.
  */
 uchar_t
-libradio_txpacket(struct channel *chp)
+libradio_txpacket(struct channel *chp, uchar_t *lenp)
 {
-	int i, len;
-	uchar_t *cp, csum;
+	int i, len, flen, npackets;
+	uchar_t *cp;
+	struct channel *nchp;
 
 	/*
-	 * First off, store our current clock timer ticks in the packet
-	 * and compute the checksum. The checksum is computed such that
-	 * a subsequent XOR of all the bytes in the packet will result
-	 * in a value of 0x00.
+	 * First off, work out how many packets we can fit in the frame.
 	 */
-	if (chp->packet.len > MAX_PAYLOAD_SIZE)
+	for (nchp = chp, npackets = flen = 0; nchp != NULL; nchp = nchp->next) {
+		if (nchp->packet.len > MAX_PAYLOAD_SIZE)
+			break;
+#ifdef LIBRADIO_SNIFF
+		if (npackets > 0 && nchp->packet.cmd == RADIO_CMD_ACTIVATE)
+			break;
+#endif
+		len = PACKET_HEADER_LEN + nchp->packet.len;
+		if (flen + len > MAX_FIFO_SIZE)
+			break;
+		flen += len;
+		npackets++;
+#ifdef LIBRADIO_VARLEN
+		if (nchp->state > LIBRADIO_CHSTATE_TRANSMIT)
+			break;
+#else
+		break;
+#endif
+	}
+	if (npackets == 0)
 		return(0);
+	/*
+	 * Now load the frame into the TX FIFO. In variable-length mode,
+	 * it's preceded by a length byte and there's no padding.
+	 */
+	pkt_burst(SI4463_WRITE_TX_FIFO);
+#ifdef LIBRADIO_VARLEN
+	spi_byte(flen);
+#endif
+	for (nchp = chp, i = 0; i < npackets; i++, nchp = nchp->next) {
+		len = pkt_txprep(nchp);
+		for (cp = (uchar_t *)&nchp->packet; len > 0; len--)
+			spi_byte(*cp++);
+	}
+#ifndef LIBRADIO_VARLEN
+	for (; flen < SI4463_PACKET_LEN; flen++)
+		spi_byte(0xff);
+#endif
+	pkt_burst_end();
+	*lenp = flen;
+	return(npackets);
+}
+
+/*
+ * Store our current clock timer ticks in the packet and compute the
+ * checksum. The checksum is computed such that a subsequent XOR of
+ * all the bytes in the packet will result in a value of 0x00. With
+ * LIBRADIO_HWCRC there is no checksum, as the radio appends a CRC-16 to
+ * the frame. Returns the packet length (including the header).
+ */
+uchar_t
+pkt_txprep(struct channel *chp)
+{
+	uchar_t len;
+#ifndef LIBRADIO_HWCRC
+	int i;
+	uchar_t *cp, csum;
+#endif
+
 	len = PACKET_HEADER_LEN + chp->packet.len;
 	cli();
+	clock_credit();
 	chp->packet.ticks = radio.ms_ticks;
 	sei();
+#ifndef LIBRADIO_HWCRC
 	chp->packet.csum = csum = 0x00;
 	for (i = 0, cp = (uchar_t *)&chp->packet; i < len; i++)
 		csum ^= *cp++;
 	chp->packet.csum = csum;
-	/*
-	 * Now load the packet data into the TX FIFO.
-	 */
-	_setss(1);
-	spi_byte(SI4463_WRITE_TX_FIFO);
-	for (i = 0, cp = (uchar_t *)&chp->packet; i < SI4463_PACKET_LEN; i++) {
-		if (i < len)
-			spi_byte(*cp++);
-		else
-			spi_byte(0xff);
-	}
-	_setss(0);
-	return(1);
+#endif
+	return(len);
 }
 
 /*
@@ -214,3 +735,94 @@ pkt_error(uchar_t i)
 	printf("spi error %d\n", i);
 	return(0);
 }
+
+#ifdef LIBRADIO_TRACE
+/*
+ * A transaction has finished. Log it in the trace ring, overwriting the
+ * oldest entry if the ring is full. Called with interrupts disabled.
+ */
+void
+trace_record(uchar_t status)
+{
+	uint_t ticks;
+	long elapsed;
+	struct trace *tp = &trace[trace_head];
+
+	elapsed = clock_counts(&ticks);
+	elapsed += (long )(ticks - trace_ticks) * (long )clock_tick_counts() - (long )trace_stamp;
+	tp->cmd = trace_cmd;
+	tp->status = status;
+	tp->polls = (pkt_polls > 255) ? 255 : pkt_polls;
+	tp->tick = trace_ticks;
+	tp->stamp = trace_stamp;
+	tp->elapsed = (elapsed > 65535L) ? 65535 : elapsed;
+	trace_head = (trace_head + 1) % LIBRADIO_TRACE_DEPTH;
+	if (trace_count < LIBRADIO_TRACE_DEPTH)
+		trace_count++;
+	if (trace_unsent < LIBRADIO_TRACE_DEPTH)
+		trace_unsent++;
+}
+
+/*
+ * Print the trace ring, oldest entry first. Each line shows the command,
+ * the result code, the CTS poll count, the start time (tick.TCNT1) and
+ * the duration in Timer1 counts (4us each, at the normal clock rate).
+ * The ring keeps filling as we print, so take a copy of each entry first.
+ */
+void
+pkt_trace_stats(uchar_t clear)
+{
+	uchar_t i, n, slot;
+	struct trace t;
+
+	cli();
+	n = trace_count;
+	slot = (trace_head + LIBRADIO_TRACE_DEPTH - n) % LIBRADIO_TRACE_DEPTH;
+	sei();
+	for (i = 0; i < n; i++) {
+		cli();
+		t = trace[slot];
+		sei();
+		printf("TR%x:S%u,P%u,T%u.%u,D%u\n", t.cmd, t.status,
+					t.polls, t.tick, t.stamp, t.elapsed);
+		slot = (slot + 1) % LIBRADIO_TRACE_DEPTH;
+	}
+	if (clear) {
+		cli();
+		trace_count = trace_unsent = 0;
+		sei();
+	}
+}
+
+/*
+ * Fill in a RADIO_STATUS_TRACE status block with the oldest trace
+ * entries which haven't been sent yet. After the status type and the
+ * number of entries still left to send, each entry is four bytes: the
+ * command, the result code (top three bits) and CTS polls (bottom five
+ * bits, saturated), and the duration in Timer1 counts. Keep asking
+ * until the count comes back as zero. Returns the block length.
+ */
+int
+pkt_trace_status(uchar_t buf[], int maxlen)
+{
+	uchar_t slot, *cp = &buf[2];
+	struct trace *tp;
+
+	if (maxlen < 2)
+		return(0);
+	cli();
+	while (trace_unsent > 0 && (cp - buf) + 4 <= maxlen) {
+		slot = (trace_head + LIBRADIO_TRACE_DEPTH - trace_unsent) % LIBRADIO_TRACE_DEPTH;
+		tp = &trace[slot];
+		*cp++ = tp->cmd;
+		*cp++ = (tp->status << 5) | ((tp->polls > 31) ? 31 : tp->polls);
+		*cp++ = (tp->elapsed >> 8) & 0xff;
+		*cp++ = tp->elapsed & 0xff;
+		trace_unsent--;
+	}
+	buf[0] = RADIO_STATUS_TRACE;
+	buf[1] = trace_unsent;
+	sei();
+	return(cp - buf);
+}
+#endif
@@ -61,6 +61,8 @@ const uchar_t	radio_config[] PROGMEM = RADIO_CONFIGURATION_DATA_ARRAY;
  * to the chip. We keep the array in program memory to save on RAM. The
  * bulk of the config happens here. The last step is to do an IR
  * calibration which is known to take up to a few seconds, so we wait...
+ * If the radio was put to sleep by libradio_power_down() and it still
+ * has its configuration, all of that is skipped.
  */
 int
 libradio_power_up()
@@ -71,6 +73,8 @@ libradio_power_up()
 	addr = 0;
 	if (radio.radio_active)
 		return(0);
+	if (radio.radio_asleep && power_resume())
+		return(0);
 	printf("PowerUp!\n");
 	while ((len = pgm_read_byte(&radio_config[addr++])) != 0) {
 		for (i = 0; i < len; i++)
@@ -81,6 +85,18 @@ libradio_power_up()
 			return(-1);
 		}
 	}
+#ifdef LIBRADIO_HW_CTS
+	/*
+	 * The GPIO config has been sent, so GPIO3 is now CTS.
+	 */
+	pkt_cts_enable(1);
+#endif
+	prop_init();
+#ifdef LIBRADIO_SNIFF
+	radio.sniffing = 0;
+#endif
+	if (radio.my_node_id != 0)
+		libradio_set_filter(radio.my_node_id);
 	libradio_get_chip_status();
 	libradio_get_part_info();
 	libradio_get_func_info();
@@ -94,13 +110,106 @@ libradio_power_up()
 }
 
 /*
- * Power-down the radio. Right now, this does nothing. It would be great
- * if there was something useful we could do, here. Sometimes the radio
- * ends up in a weird state and only power-cycling the entire system
- * can fix it.
+ * Power-down the radio. Put the chip into the SLEEP state, which retains
+ * the configuration (and turns off everything except the SPI interface
+ * and, if enabled, the 32kHz clock). The chip wakes up again on the
+ * next SPI access, so the matching libradio_power_up() can usually skip
+ * the configuration upload. Sometimes the radio ends up in a weird state
+ * and only power-cycling the entire system can fix it.
  */
 void
 libradio_power_down()
 {
+	if (!radio.radio_active)
+		return;
+	libradio_tx_flush();
+	libradio_change_radio_state(SI4463_STATE_SLEEP);
 	radio.radio_active = 0;
+	radio.radio_asleep = 1;
+#ifdef LIBRADIO_HW_CTS
+	pkt_cts_enable(0);
+#endif
+}
+
+/*
+ * Bring the radio back from SLEEP. The SPI access wakes it up, and if
+ * the FRR_CTL_A_MODE property still has our value, then the rest of the
+ * configuration is intact too. Clear out anything latched while we were
+ * asleep and return 1. If the chip has lost its configuration (a brownout,
+ * for example), return 0 and let the caller reload it.
+ */
+int
+power_resume()
+{
+	int i;
+
+	radio.radio_asleep = 0;
+	pkt_data[0] = SI4463_GET_PROPERTY;
+	pkt_data[1] = SI4463_PROP_FRR_CTL_A_MODE >> 8;
+	pkt_data[2] = 1;
+	pkt_data[3] = SI4463_PROP_FRR_CTL_A_MODE & 0xff;
+	if ((i = pkt_send(4, 1)) != SPI_SEND_OK) {
+		pkt_error(i);
+		return(0);
+	}
+	if (pkt_data[0] != SI4463_FRR_CURRENT_STATE)
+		return(0);
+#ifdef LIBRADIO_HW_CTS
+	pkt_cts_enable(1);
+#endif
+	libradio_get_int_status();
+	libradio_get_fifo_info(03);
+	radio.curr_state = SI4463_STATE_SPI_ACTIVE;
+	radio.radio_active = 1;
+	return(1);
+}
+
+#ifdef LIBRADIO_SNIFF
+/*
+ * Turn low duty cycle receive on or off. When it's on, the radio is
+ * left asleep on the sleepy channel (zero) and the wake-up timer has it
+ * sniff for preamble every 31.25ms. If it hears one, it stays in RX for
+ * the packet, which raises the usual RX interrupt. The RX parameters
+ * (channel and next states) are those of the START_RX issued here. When
+ * it's off, the wake-up timer is stopped and the radio goes back to
+ * receiving all the time on our channel.
+ */
+void
+libradio_sniff(uchar_t on)
+{
+	if (on == radio.sniffing)
+		return;
+	if (!radio.radio_active && libradio_power_up() < 0)
+		return;
+	if (on) {
+		libradio_tx_flush();
+		radio.my_channel = 0;
+		libradio_set_rx(0);
+	}
+	libradio_set_property(SI4463_PROP_WUT,
+				on ? (SI4463_WUT_LDC_RX | SI4463_WUT_EN | SI4463_WUT_CAL_EN) : 0);
+	libradio_set_property(SI4463_PROP_WUT + 1, SNIFF_WUT_M >> 8);
+	libradio_set_property(SI4463_PROP_WUT + 2, SNIFF_WUT_M & 0xff);
+	libradio_set_property(SI4463_PROP_WUT + 3, SI4463_WUT_SLEEP | SNIFF_WUT_R);
+	libradio_set_property(SI4463_PROP_WUT + 4, SNIFF_WUT_LDC);
+	libradio_prop_flush();
+	radio.sniffing = on;
+	if (on)
+		libradio_change_radio_state(SI4463_STATE_SLEEP);
+	else {
+		libradio_read_frr();
+		libradio_set_rx(radio.my_channel);
+	}
+}
+
+/*
+ * Set the TX preamble length (in bytes). Nothing is sent to the radio
+ * if it hasn't changed.
+ */
+void
+libradio_set_preamble(uchar_t len)
+{
+	libradio_set_property(SI4463_PROP_PREAMBLE_TX_LEN, len);
+	libradio_prop_flush();
 }
+#endif
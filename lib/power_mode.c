@@ -53,6 +53,7 @@ void
 libradio_power_mode(uchar_t hi_flag)
 {
 	cli();
+	clock_credit();
 	if (hi_flag) {
 		radio.period = radio.fast_period;
 		TCCR1B = (1<<WGM12)|(1<<CS11)|(1<<CS10);
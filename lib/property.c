@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2020-24, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Radio property handling. The values in the configuration blob (see
+ * power.c) are the defaults, and anything changed since the blob was
+ * loaded is kept in a small shadow table in RAM. Writes to consecutive
+ * properties in the same group are held back and sent as a single
+ * SET_PROPERTY command of up to twelve properties, and writes which
+ * wouldn't change anything are dropped.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include <libavr.h>
+
+#include "libradio.h"
+#include "internal.h"
+
+struct	propshadow	{
+	uint_t	prop;
+	uchar_t	value;
+};
+
+struct propshadow	prop_shadow[LIBRADIO_PROP_SHADOW];
+uchar_t				prop_nshadow;
+uchar_t				prop_overflow;
+uchar_t				prop_buf[4 + SI4463_MAX_PROPS];
+uint_t				prop_start;
+uchar_t				prop_count;
+
+/*
+ * Forget everything we know about changed properties. Called when the
+ * configuration blob has been (re)loaded into the radio.
+ */
+void
+prop_init()
+{
+	prop_nshadow = prop_count = prop_overflow = 0;
+}
+
+/*
+ * Look for a property in the configuration blob. Each entry is a
+ * length byte followed by a command, and we're only interested in the
+ * SET_PROPERTY commands. Returns the value or -1 if it isn't there.
+ */
+int
+prop_default(uint_t prop)
+{
+	uchar_t len, first, nprops;
+	int addr = 0;
+
+	while ((len = pgm_read_byte(&radio_config[addr])) != 0) {
+		if (pgm_read_byte(&radio_config[addr + 1]) == SI4463_SET_PROPERTY &&
+				pgm_read_byte(&radio_config[addr + 2]) == (prop >> 8)) {
+			nprops = pgm_read_byte(&radio_config[addr + 3]);
+			first = pgm_read_byte(&radio_config[addr + 4]);
+			if ((prop & 0xff) >= first && (prop & 0xff) < first + nprops)
+				return(pgm_read_byte(&radio_config[addr + 5 + (prop & 0xff) - first]));
+		}
+		addr += len + 1;
+	}
+	return(-1);
+}
+
+/*
+ * Return the value of a radio property as far as we know it, without
+ * asking the radio. This includes any write still waiting to be sent.
+ * Returns -1 if the property isn't in the configuration blob and hasn't
+ * been written since. Once the shadow table has overflowed, the blob
+ * default can't be trusted for anything not in the table, so that's
+ * -1 too.
+ */
+int
+libradio_prop_value(uint_t prop)
+{
+	uchar_t i;
+
+	if (prop_count > 0 && prop >= prop_start && prop < prop_start + prop_count)
+		return(prop_buf[4 + prop - prop_start]);
+	for (i = 0; i < prop_nshadow; i++)
+		if (prop_shadow[i].prop == prop)
+			return(prop_shadow[i].value);
+	if (prop_overflow)
+		return(-1);
+	return(prop_default(prop));
+}
+
+/*
+ * Record a property value which has made it to the radio. If it's back
+ * to the blob default, the shadow entry is no longer needed. If the
+ * table is full, the value can't be remembered, so note that the table
+ * has overflowed. From then on, until the blob is reloaded, a write to
+ * any property which isn't in the table is always sent.
+ */
+void
+prop_record(uint_t prop, uchar_t value)
+{
+	uchar_t i;
+	int def;
+
+	def = prop_default(prop);
+	for (i = 0; i < prop_nshadow; i++) {
+		if (prop_shadow[i].prop != prop)
+			continue;
+		if (def == value)
+			prop_shadow[i] = prop_shadow[--prop_nshadow];
+		else
+			prop_shadow[i].value = value;
+		return;
+	}
+	if (def == value)
+		return;
+	if (prop_nshadow < LIBRADIO_PROP_SHADOW) {
+		prop_shadow[prop_nshadow].prop = prop;
+		prop_shadow[prop_nshadow++].value = value;
+	} else
+		prop_overflow = 1;
+}
+
+/*
+ * Send any property writes which are being held back, as a single
+ * SET_PROPERTY command.
+ */
+void
+libradio_prop_flush()
+{
+	uchar_t i;
+
+	if (prop_count == 0)
+		return;
+	prop_buf[0] = SI4463_SET_PROPERTY;
+	prop_buf[1] = prop_start >> 8;
+	prop_buf[2] = prop_count;
+	prop_buf[3] = prop_start & 0xff;
+	for (i = 0; i < prop_count + 4; i++)
+		pkt_data[i] = prop_buf[i];
+	if ((i = pkt_send(prop_count + 4, 0)) != SPI_SEND_OK)
+		pkt_error(i);
+	else {
+		for (i = 0; i < prop_count; i++)
+			prop_record(prop_start + i, prop_buf[4 + i]);
+	}
+	prop_count = 0;
+}
+
+/*
+ * Set a radio property. The properties are specified as two-byte
+ * parameters (group and index). See AN625.pdf from Silicon Labs for
+ * more information on the properties. If the property already has this
+ * value, nothing happens. Otherwise the write is added to the pending
+ * SET_PROPERTY command if it follows on from it, or the pending command
+ * is sent and a new one started. Call libradio_prop_flush() once all
+ * the properties have been set.
+ */
+void
+libradio_set_property(uint_t prop, uchar_t value)
+{
+	if (libradio_prop_value(prop) == value)
+		return;
+	if (prop_count > 0 && prop >= prop_start && prop < prop_start + prop_count) {
+		prop_buf[4 + prop - prop_start] = value;
+		return;
+	}
+	if (prop_count > 0 && (prop != prop_start + prop_count ||
+					(prop >> 8) != (prop_start >> 8) ||
+					prop_count >= SI4463_MAX_PROPS))
+		libradio_prop_flush();
+	if (prop_count == 0)
+		prop_start = prop;
+	prop_buf[4 + prop_count++] = value;
+}
@@ -44,6 +44,13 @@
 #include "libradio.h"
 #include "internal.h"
 
+void	clr_start();
+void	clr_done(struct pkt_xact *);
+
+uchar_t			clr_data[4];
+uchar_t			clr_again;
+struct pkt_xact	clr_xact = {clr_data, 4, 0, SPI_SEND_OK, clr_done};
+
 /*
  * Request the status of the radio from the radio itself. It returns the
  * device status, such as SI4463_STATE_READY. It also implicitly sets
@@ -63,6 +70,71 @@ libradio_request_device_status()
 	return(radio.curr_state = pkt_data[0]);
 }
 
+/*
+ * Read the four Fast Response Registers in a single SPI burst. Unlike
+ * every other command, there's no need to wait for CTS. The FRRs are
+ * configured (in radio_config.h) to return the current state, the
+ * packet handler pending bits, the latched RSSI and the modem pending
+ * bits. Note that reading the FRRs doesn't clear any pending interrupts.
+ * Returns the current state.
+ */
+uchar_t
+libradio_read_frr()
+{
+	pkt_burst(SI4463_FRR_A_READ);
+	radio.curr_state = spi_byte(0xff) & 0x0f;
+	radio.ph_pending = spi_byte(0xff);
+	radio.latch_rssi = spi_byte(0xff);
+	radio.modem_pending = spi_byte(0xff);
+	pkt_burst_end();
+	return(radio.curr_state);
+}
+
+/*
+ * Clear all pending radio interrupts, without reading back the status.
+ * This is queued on the SPI engine and we don't wait for it to complete,
+ * although the next synchronous SPI operation will. If the last one is
+ * still in the queue, an interrupt may have arrived since it was sent,
+ * so ask for it to be sent again once it's done.
+ */
+void
+libradio_clear_int()
+{
+	uchar_t sreg = SREG;
+
+	cli();
+	if (clr_xact.status == SPI_SEND_BUSY)
+		clr_again = 1;
+	else
+		clr_start();
+	SREG = sreg;
+}
+
+/*
+ * Queue the GET_INT_STATUS transaction. The response overwrites the
+ * buffer, so it has to be filled in every time.
+ */
+void
+clr_start()
+{
+	clr_data[0] = SI4463_GET_INT_STATUS;
+	clr_data[1] = clr_data[2] = clr_data[3] = 0;
+	pkt_submit(&clr_xact);
+}
+
+/*
+ * Called from the SPI interrupt when the clear has gone out. Send
+ * another if one was asked for in the meantime.
+ */
+void
+clr_done(struct pkt_xact *xp)
+{
+	if (clr_again) {
+		clr_again = 0;
+		clr_start();
+	}
+}
+
 /*
  * Retrieve a property from the radio. The properties are specified
  * as two-byte parameters. See AN625.pdf from Silicon Labs for more
@@ -87,13 +159,26 @@ libradio_get_property(uint_t start_prop, uchar_t nprops)
 }
 
 /*
- * Set a radio property. The properties are specified as two-byte
- * parameters. See AN625.pdf from Silicon Labs for more information on
- * the properties. Currently unused and unimplemented.
+ * Program the packet handler match engine so that the radio only passes
+ * on packets for this node, or broadcasts (node 0). Anything else is
+ * dropped by the radio without raising an interrupt. A node ID of zero
+ * turns the filter off. In variable-length mode a frame can carry packets
+ * for several nodes, so the filter is never enabled.
  */
 void
-libradio_set_property()
+libradio_set_filter(uchar_t node)
 {
+#ifndef LIBRADIO_VARLEN
+	libradio_set_property(SI4463_PROP_MATCH, node);
+	libradio_set_property(SI4463_PROP_MATCH + 1, 0xff);
+	libradio_set_property(SI4463_PROP_MATCH + 2,
+				(node != 0) ? (SI4463_MATCH_EN | SI4463_MATCH_OFFSET) : 0);
+	libradio_set_property(SI4463_PROP_MATCH + 3, 0);
+	libradio_set_property(SI4463_PROP_MATCH + 4, 0xff);
+	libradio_set_property(SI4463_PROP_MATCH + 5,
+				(node != 0) ? (SI4463_MATCH_OR | SI4463_MATCH_OFFSET) : 0);
+	libradio_prop_flush();
+#endif
 }
 
 /*
@@ -234,6 +319,8 @@ libradio_change_radio_state(uchar_t new_state)
 uchar_t
 libradio_get_fifo_info(uchar_t clrf)
 {
+	if (clrf & 02)
+		pkt_rxlen = 0;
 	pkt_data[0] = SI4463_FIFO_INFO;
 	pkt_data[1] = clrf;
 	if (pkt_send(2, 2) != SPI_SEND_OK)
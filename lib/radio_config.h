@@ -82,7 +82,14 @@
 // Command:                  RF_GPIO_PIN_CFG
 // Description:              Configures the GPIO pins.
 */
+#ifdef LIBRADIO_HW_CTS
+/*
+// GPIO3 is a CTS output (with pull-up) wired to PB0 on the AVR.
+*/
+#define RF_GPIO_PIN_CFG 0x13, 0x60, 0x61, 0x53, 0x48, 0x67, 0x00, 0x00
+#else
 #define RF_GPIO_PIN_CFG 0x13, 0x60, 0x61, 0x53, 0x54, 0x67, 0x00, 0x00
+#endif
 
 /*
 // Set properties:           RF_GLOBAL_XO_TUNE_2
@@ -94,7 +101,15 @@
 //   GLOBAL_XO_TUNE - Configure the internal capacitor frequency tuning bank for the crystal oscillator.
 //   GLOBAL_CLK_CFG - Clock configuration options.
 */
+#ifdef LIBRADIO_SNIFF
+/*
+// Modified: GLOBAL_CLK_CFG enables the 32kHz RC oscillator for the
+// wake-up timer.
+*/
+#define RF_GLOBAL_XO_TUNE_2 0x11, 0x00, 0x02, 0x00, 0x52, 0x01
+#else
 #define RF_GLOBAL_XO_TUNE_2 0x11, 0x00, 0x02, 0x00, 0x52, 0x00
+#endif
 
 /*
 // Set properties:           RF_GLOBAL_CONFIG_1
@@ -117,7 +132,16 @@
 //   INT_CTL_ENABLE - This property provides for global enabling of the three interrupt groups (Chip, Modem and Packet Handler) in order to generate HW interrupts at the NIRQ pin.
 //   INT_CTL_PH_ENABLE - Enable individual interrupt sources within the Packet Handler Interrupt Group to generate a HW interrupt on the NIRQ output pin.
 */
-#define RF_INT_CTL_ENABLE_2 0x11, 0x01, 0x02, 0x00, 0x01, 0x10
+/*
+// Modified: Raise NIRQ on PACKET_SENT, so that the end of a transmission
+// doesn't need to be polled for. With LIBRADIO_HWCRC, also raise it on
+// CRC_ERROR so that bad frames can be flushed without being read.
+*/
+#ifdef LIBRADIO_HWCRC
+#define RF_INT_CTL_ENABLE_2 0x11, 0x01, 0x02, 0x00, 0x01, 0x38
+#else
+#define RF_INT_CTL_ENABLE_2 0x11, 0x01, 0x02, 0x00, 0x01, 0x30
+#endif
 
 /*
 // Set properties:           RF_INT_CTL_CHIP_ENABLE_1
@@ -142,7 +166,11 @@
 //   FRR_CTL_C_MODE - Fast Response Register C Configuration.
 //   FRR_CTL_D_MODE - Fast Response Register D Configuration.
 */
-#define RF_FRR_CTL_A_MODE_4 0x11, 0x02, 0x04, 0x00, 0x09, 0x03, 0x07, 0x01
+/*
+// Modified: FRR A is the current state, B is the PH pending bits, C is
+// the latched RSSI and D is the modem pending bits. See libradio_read_frr().
+*/
+#define RF_FRR_CTL_A_MODE_4 0x11, 0x02, 0x04, 0x00, 0x09, 0x04, 0x0A, 0x06
 
 /*
 // Set properties:           RF_PREAMBLE_TX_LENGTH_9
@@ -193,7 +221,15 @@
 //   PKT_WHT_BIT_NUM - Selects which bit of the LFSR (used to generate the PN / data whitening sequence) is used as the output bit for data scrambling.
 //   PKT_CONFIG1 - General configuration bits for transmission or reception of a packet.
 */
+#ifdef LIBRADIO_VARLEN
+/*
+// Modified: PKT_CONFIG1 sets PH_FIELD_SPLIT so that RX uses the separate
+// RX field configuration (variable-length, see below).
+*/
+#define RF_PKT_CRC_CONFIG_7 0x11, 0x12, 0x07, 0x00, 0x84, 0x01, 0x08, 0xFF, 0xFF, 0x00, 0x82
+#else
 #define RF_PKT_CRC_CONFIG_7 0x11, 0x12, 0x07, 0x00, 0x84, 0x01, 0x08, 0xFF, 0xFF, 0x00, 0x02
+#endif
 
 /*
 // Set properties:           RF_PKT_LEN_12
@@ -215,7 +251,15 @@
 //   PKT_FIELD_2_LENGTH_7_0 - Unsigned 13-bit Field 2 length value.
 //   PKT_FIELD_2_CONFIG - General data processing and packet configuration bits for Field 2.
 */
+#ifdef LIBRADIO_VARLEN
+/*
+// Modified: PKT_LEN is a one-byte length, stored in the FIFO, which gives
+// the length of RX field 2. It is found in RX field 1.
+*/
+#define RF_PKT_LEN_12 0x11, 0x12, 0x0C, 0x08, 0x0A, 0x01, 0x00, 0x30, 0x30, 0x00, 0x20, 0x04, 0xAA, 0x00, 0x00, 0x00
+#else
 #define RF_PKT_LEN_12 0x11, 0x12, 0x0C, 0x08, 0x00, 0x00, 0x00, 0x30, 0x30, 0x00, 0x20, 0x04, 0xAA, 0x00, 0x00, 0x00
+#endif
 
 /*
 // Set properties:           RF_PKT_FIELD_2_CRC_CONFIG_12
@@ -259,7 +303,15 @@
 //   PKT_RX_FIELD_3_LENGTH_7_0 - Unsigned 13-bit RX Field 3 length value.
 //   PKT_RX_FIELD_3_CONFIG - General data processing and packet configuration bits for RX Field 3.
 */
+#ifdef LIBRADIO_VARLEN
+/*
+// Modified: RX field 1 is the one-byte length (CRC starts here). RX field
+// 2 is the packet, up to 48 bytes, followed by the CRC.
+*/
+#define RF_PKT_FIELD_5_CRC_CONFIG_12 0x11, 0x12, 0x0C, 0x20, 0x00, 0x00, 0x01, 0x04, 0x82, 0x00, 0x30, 0x00, 0x2A, 0x00, 0x00, 0x00
+#else
 #define RF_PKT_FIELD_5_CRC_CONFIG_12 0x11, 0x12, 0x0C, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+#endif
 
 /*
 // Set properties:           RF_PKT_RX_FIELD_3_CRC_CONFIG_9
@@ -61,72 +61,222 @@ libradio_recv_start()
 }
 
 /*
- * Receive packet data from the radio receiver. Do this by querying the
- * FIFO status, and if there's at least one packet in the FIFO, pull
- * it out. If the checksum is bad or the retrieval fails, then flush
- * the RX FIFO. If we're using RX interrupts, re-enable them. Finally,
- * if we're no longer in RX mode, then re-enable it.
+ * Receive packet data from the radio receiver. Do this by reading the
+ * Fast Response Registers and the FIFO count, and if there's a complete
+ * packet in the FIFO, pull it out. The radio stays in RX after a valid
+ * packet, so others may be queued up behind this one. The interrupt is
+ * only cleared once the FIFO is empty, and the caller will find the rest
+ * on the next call. If the hardware CRC failed, any good packets in
+ * front of the bad frame are still read out, one per call, and then the
+ * bad frame is flushed. If the checksum is bad, only that packet is
+ * dropped. If we're using RX interrupts, re-enable them. Finally, if
+ * we're no longer in RX mode (and not still transmitting), then
+ * re-enable it. The FRRs also give us the radio state.
  */
 uchar_t
 libradio_recv(struct channel *chp, uchar_t channo)
 {
-	uchar_t ret = 0;
+	uchar_t avail, ret = 0;
 
 	/*
-	 * First up, check the RX fifo to see if we have a packet.
+	 * First up, check the FRRs and the FIFO to see if we have a packet.
 	 */
-	if (libradio_check_rx()) {
+	libradio_read_frr();
+	if (radio.tx_state != LIBRADIO_TX_IDLE && (radio.ph_pending & SI4463_PH_PACKET_SENT))
+		libradio_tx_finish();
+	if (radio.ph_pending & SI4463_PH_CRC_ERROR) {
 		/*
-		 * There's at least a packet. Go get it!
+		 * The hardware CRC failed on the last frame in the FIFO. Pull
+		 * out the next good packet in front of it, if there is one,
+		 * and leave the interrupt pending. Once there's nothing left
+		 * but the bad frame, throw it away.
 		 */
-		if ((ret = libradio_rxpacket(chp)) == 0) {
-			/*
-			 * Got a defective packet - clear the RX FIFO
-			 * in case there's more. This is a particularly
-			 * awkward thing to do because the FIFO may be
-			 * in the throes of receiving the next packet. In
-			 * which case, we'll end up with a partial packet
-			 * in the FIFO and we'll never get it out. Ideally
-			 * here some sort of "I haven't received data
-			 * in X seconds, so flush any crud out of the
-			 * FIFO" might not be a bad way to go. Or if
-			 * the FIFO has had less than a packet-load for
-			 * N milliseconds, flush it.
-			 */
-			libradio_get_fifo_info(02);
-		} else {
+		if ((avail = libradio_crc_good(libradio_get_fifo_info(0))) > 0 &&
+						(ret = libradio_rxburst(chp, 1, avail)) > 0) {
 			radio.npacket_rx++;
+			radio.link[LINK_RX_GOOD]++;
 			radio.saw_rx = 1;
 		}
+		if (libradio_crc_good(libradio_get_fifo_info(0)) == 0)
+			libradio_crc_error();
+		if (radio.catch_irq)
+			libradio_irq_enable(1);
+	} else if ((avail = libradio_get_fifo_info(0)) >= SI4463_MIN_FRAME ||
+					(pkt_rxlen != 0 && avail > 0)) {
+		/*
+		 * There's at least a packet. Go get it! A packet with a bad
+		 * checksum has already been read out of the FIFO (and
+		 * counted), so there's nothing to clean up. Any good packets
+		 * queued behind it are left where they are.
+		 */
+		if ((ret = libradio_rxburst(chp, 1, avail)) > 0) {
+			radio.npacket_rx++;
+			radio.link[LINK_RX_GOOD]++;
+			radio.saw_rx = 1;
+		}
+		/*
+		 * Leave the interrupt pending while there are still packets
+		 * in the FIFO. If we caught an IRQ notification, re-enable
+		 * interrupts now that we've pulled the packet.
+		 */
+		if (libradio_get_fifo_info(0) < SI4463_MIN_FRAME && pkt_rxlen == 0)
+			libradio_clear_int();
+		if (radio.catch_irq)
+			libradio_irq_enable(1);
+	}
+	if (radio.curr_state == SI4463_STATE_TX || radio.curr_state == SI4463_STATE_TX_TUNE)
+		return(ret);
+	if (radio.curr_state != SI4463_STATE_RX || radio.curr_channel != channo)
+		libradio_set_rx(channo);
+	return(ret);
+}
+
+/*
+ * Drain every complete packet from the RX FIFO, up to a maximum of
+ * npackets, into the chp[] array. This costs one FIFO_INFO query and a
+ * single READ_RX_FIFO transaction, regardless of how many packets are
+ * waiting. Bad packets are dropped and the good ones are packed into the
+ * start of the array. Any interrupts are cleared before the FIFO is read
+ * so that a packet arriving during the burst will raise a new one. If
+ * the packet handler has flagged a CRC error, the good packets in front
+ * of the bad frame are read (leaving the interrupt pending, if there
+ * are more than will fit), and then the bad frame is flushed. Returns
+ * the number of good packets.
+ */
+uchar_t
+libradio_recv_burst(struct channel chp[], uchar_t npackets, uchar_t channo)
+{
+	uchar_t avail, ret = 0;
+
+	libradio_read_frr();
+	if (radio.tx_state != LIBRADIO_TX_IDLE && (radio.ph_pending & SI4463_PH_PACKET_SENT))
+		libradio_tx_finish();
+	if ((avail = libradio_get_fifo_info(0)) >= SI4463_RX_FIFO_LEN)
+		radio.link[LINK_RX_OVERFLOW]++;
+	if (radio.ph_pending & SI4463_PH_CRC_ERROR) {
 		/*
-		 * If we caught an IRQ notification, re-enable interrupts now that
-		 * we've pulled the packet.
+		 * The last frame in the FIFO failed the CRC. Anything in
+		 * front of it is still good, so pull that out first.
 		 */
+		if ((avail = libradio_crc_good(avail)) > 0 &&
+						(ret = libradio_rxburst(chp, npackets, avail)) > 0) {
+			radio.npacket_rx += ret;
+			radio.link[LINK_RX_GOOD] += ret;
+			radio.saw_rx = 1;
+		}
+		if (libradio_crc_good(libradio_get_fifo_info(0)) == 0)
+			libradio_crc_error();
+		if (radio.catch_irq)
+			libradio_irq_enable(1);
+	} else if (avail >= SI4463_MIN_FRAME || (pkt_rxlen != 0 && avail > 0)) {
+		libradio_clear_int();
+		if ((ret = libradio_rxburst(chp, npackets, avail)) > 0) {
+			radio.npacket_rx += ret;
+			radio.link[LINK_RX_GOOD] += ret;
+			radio.saw_rx = 1;
+		}
 		if (radio.catch_irq)
 			libradio_irq_enable(1);
 	}
-	if (libradio_request_device_status() != SI4463_STATE_RX ||
-					radio.curr_channel != channo)
+	libradio_read_frr();
+	if (radio.curr_state == SI4463_STATE_TX || radio.curr_state == SI4463_STATE_TX_TUNE)
+		return(ret);
+	if (radio.curr_state != SI4463_STATE_RX || radio.curr_channel != channo)
 		libradio_set_rx(channo);
 	return(ret);
 }
 
 /*
- * Put the radio into RX mode.
+ * The packet handler has flagged a CRC error on the last frame in the
+ * RX FIFO, which holds avail bytes. Return how many bytes in front of
+ * it can safely be read. In fixed-length mode, the bad frame is the
+ * last SI4463_MAX_FRAME bytes. In variable-length mode we don't know
+ * how long it is, but a frame we've already started on is good if it
+ * doesn't run to the end of the FIFO, and so is one which starts more
+ * than a full frame from the end. A short good frame just in front of
+ * a short bad one can't be told apart from it, and is lost with it.
+ */
+uchar_t
+libradio_crc_good(uchar_t avail)
+{
+#ifdef LIBRADIO_VARLEN
+	if (pkt_rxlen != 0)
+		return((avail > pkt_rxlen) ? pkt_rxlen : 0);
+#endif
+	return((avail > SI4463_MAX_FRAME) ? avail - SI4463_MAX_FRAME : 0);
+}
+
+/*
+ * The packet handler has flagged a CRC error. The bad frame is sitting
+ * in the RX FIFO (the radio is still in RX), so clear the interrupt,
+ * flush the FIFO and count the failure against the channel.
+ */
+void
+libradio_crc_error()
+{
+	libradio_clear_int();
+	libradio_get_fifo_info(02);
+	libradio_crc_count();
+}
+
+/*
+ * Count a CRC (or checksum) failure on the current channel.
+ */
+void
+libradio_crc_count()
+{
+	radio.link[LINK_RX_BAD]++;
+	if (radio.curr_channel < LIBRADIO_NCHANNELS)
+		radio.chstats[radio.curr_channel].crc_errors++;
+}
+
+/*
+ * Print the per-channel CRC failure counts, alongside the number of
+ * good packets received.
+ */
+void
+libradio_crc_stats(uchar_t clear)
+{
+	int i;
+
+	printf("RX%u", radio.npacket_rx);
+	for (i = 0; i < LIBRADIO_NCHANNELS; i++) {
+		printf(",C%d:%u", i, radio.chstats[i].crc_errors);
+		if (clear)
+			radio.chstats[i].crc_errors = 0;
+	}
+	putchar('\n');
+}
+
+/*
+ * Put the radio into RX mode. After a valid packet, the radio stays in
+ * RX so that back-to-back packets can queue up in the FIFO. It also
+ * stays in RX after an invalid one. A packet for another node fails the
+ * match engine (see libradio_set_filter()) and aborts as invalid, but
+ * FILTER_MISS doesn't raise an interrupt, so nothing would be around to
+ * re-arm the receiver. If we're already in RX and just changing channel,
+ * hop rather than re-tuning.
  */
 void
 libradio_set_rx(uchar_t channo)
 {
 	int i;
 
+	if (radio.curr_state == SI4463_STATE_RX && radio.curr_channel != channo &&
+						libradio_rx_hop(channo))
+		return;
 	pkt_data[0] = SI4463_START_RX;
 	pkt_data[1] = channo;
 	pkt_data[2] = 0;		/* CONDITION: Start immediately */
 	pkt_data[3] = 0;		/* RXLen(hi) */
+#ifdef LIBRADIO_VARLEN
+	pkt_data[4] = 0;		/* Use the packet length field */
+#else
 	pkt_data[4] = SI4463_PACKET_LEN;
+#endif
 	pkt_data[5] = SI4463_STATE_NOCHANGE;
-	pkt_data[6] = SI4463_STATE_READY;
-	pkt_data[7] = SI4463_STATE_READY;
+	pkt_data[6] = SI4463_STATE_RX;
+	pkt_data[7] = SI4463_STATE_RX;
 	if ((i = pkt_send(8, 0)) != SPI_SEND_OK)
 		pkt_error(i);
 	radio.curr_channel = channo;
@@ -136,12 +286,19 @@ libradio_set_rx(uchar_t channo)
  * Transmit data via the radio transmitter. Note that if it is still powering
  * up then we'll need to wait a bit. Likewise, if the radio is asleep, we
  * will need to bring it back online. Only send the packet if we are in a
- * READY state and the FIFO has space.
+ * READY state and the FIFO has space. In variable-length mode, packets
+ * chained on to this one (via chp->next) are sent in the same frame.
+ * With LIBRADIO_CSMA, the channel must also be clear (see csma.c). We
+ * don't wait for the transmission to end. The PACKET_SENT interrupt tells
+ * us when it has (see libradio_tx_intr()). Returns the number of packets
+ * sent.
  */
 uchar_t
 libradio_send(struct channel *chp, uchar_t channo)
 {
-	int i;
+	int i, n;
+	uchar_t flen;
+	struct channel *lchp;
 
 	/*
 	 * Power up the radio, if necessary.
@@ -154,46 +311,137 @@ libradio_send(struct channel *chp, uchar_t channo)
 	 * could be in an RX state if we're waiting for a response packet
 	 * from the client.
 	 */
-	libradio_request_device_status();
-	if (radio.curr_state != SI4463_STATE_READY && radio.curr_state != SI4463_STATE_RX)
+	libradio_read_frr();
+	if (radio.curr_state != SI4463_STATE_READY && radio.curr_state != SI4463_STATE_RX) {
+		radio.link[LINK_TX_NOTREADY]++;
 		return(0);
+	}
+	/*
+	 * Clear out a stale PACKET_SENT, if nobody was listening for the IRQ
+	 * last time, so that this transmission gets a fresh one.
+	 */
+	if (radio.ph_pending & SI4463_PH_PACKET_SENT)
+		libradio_clear_int();
+#ifdef LIBRADIO_CSMA
+	/*
+	 * Listen before we talk. If the channel is busy, or we're still
+	 * backing off, try again later.
+	 */
+	if (libradio_cca(channo) == 0)
+		return(0);
+#endif
+#ifdef LIBRADIO_SNIFF
+	/*
+	 * Clients on the sleepy channel might be sniffing, so make sure
+	 * the preamble of an activation is long enough for them to catch
+	 * it. Everything else goes out with the normal preamble.
+	 */
+	libradio_set_preamble(SNIFF_WAKEUP(channo, &chp->packet) ? SNIFF_PREAMBLE_LEN : SI4463_PREAMBLE_LEN);
+#endif
 	/*
 	 * Check we have sufficient space in the transmit FIFO for
 	 * the packet.
 	 */
-	if (libradio_check_tx() == 0)
+	if (libradio_check_tx() == 0) {
+		radio.link[LINK_TX_FULL]++;
 		return(0);
+	}
 	/*
 	 * Finally! We're clear for launch! Transmit the packet contents
 	 * to the TX FIFO and spin up a TRANSMIT request. Note that if
-	 * the packet type indicates a response is required, then switch
-	 * to RX mode afterwards. Otherwise, drop back to READY.
+	 * the (last) packet type indicates a response is required, then
+	 * switch to RX mode afterwards. Otherwise, drop back to READY.
 	 */
-	if (libradio_txpacket(chp) == 0)
+	if ((n = libradio_txpacket(chp, &flen)) == 0)
 		return(0);
+	for (lchp = chp, i = 1; i < n; i++)
+		lchp = lchp->next;
 	pkt_data[0] = SI4463_START_TX;
 	pkt_data[1] = channo;
-	if (chp->state > LIBRADIO_CHSTATE_TRANSMIT)
+	if (lchp->state > LIBRADIO_CHSTATE_TRANSMIT)
 		i = SI4463_STATE_RX;
 	else
 		i = SI4463_STATE_READY;
 	pkt_data[2] = (i << 4);
 	pkt_data[3] = 0;
+#ifdef LIBRADIO_VARLEN
+	pkt_data[4] = 1 + flen;
+#else
 	pkt_data[4] = SI4463_PACKET_LEN;
+#endif
 	i = pkt_send(5, 0);
 	if (i != SPI_SEND_OK)
 		return(pkt_error(i));
-	radio.npacket_tx++;
+	radio.curr_channel = channo;
+	radio.curr_state = SI4463_STATE_TX;
+	radio.tx_state = LIBRADIO_TX_SENDING;
+	radio.npacket_tx += n;
+	return(n);
+}
+
+/*
+ * The radio IRQ has fired. If we're waiting for a transmission to end,
+ * check the FRRs to see if that's what it was. If so, finish off the
+ * transmission and re-enable the IRQ. Returns non-zero if the interrupt
+ * has been dealt with, or zero if it's for the receive code.
+ */
+uchar_t
+libradio_tx_intr()
+{
+	if (radio.tx_state == LIBRADIO_TX_IDLE)
+		return(0);
+	libradio_read_frr();
+	if ((radio.ph_pending & SI4463_PH_PACKET_SENT) == 0)
+		return(0);
+	libradio_tx_finish();
+	if (radio.ph_pending & (SI4463_PH_PACKET_RX | SI4463_PH_CRC_ERROR))
+		return(0);
+	if (radio.catch_irq)
+		libradio_irq_enable(1);
 	return(1);
 }
 
+/*
+ * Wait for a transmission in progress to end. The IRQ won't be enabled
+ * if we're in the middle of dealing with a packet, so poll the FRRs. This
+ * is only needed when transmissions are sent back to back, or before the
+ * radio is put to sleep.
+ */
+void
+libradio_tx_flush()
+{
+	if (radio.tx_state == LIBRADIO_TX_IDLE)
+		return;
+	while (libradio_read_frr() == SI4463_STATE_TX ||
+					radio.curr_state == SI4463_STATE_TX_TUNE)
+		;
+	libradio_tx_finish();
+}
+
+/*
+ * The transmission has ended. Clear the interrupt (unless there's
+ * a received packet waiting, which will clear it for us) and if it was
+ * a response, go back to receiving on our channel.
+ */
+void
+libradio_tx_finish()
+{
+	uchar_t rearm = (radio.tx_state == LIBRADIO_TX_RESPOND);
+
+	radio.tx_state = LIBRADIO_TX_IDLE;
+	if ((radio.ph_pending & (SI4463_PH_PACKET_RX | SI4463_PH_CRC_ERROR)) == 0)
+		libradio_clear_int();
+	if (rearm)
+		libradio_recv_start();
+}
+
 /*
  * Check if we have received at least one packet.
  */
 uchar_t
 libradio_check_rx()
 {
-	return(libradio_get_fifo_info(0) >= SI4463_PACKET_LEN);
+	return(libradio_get_fifo_info(0) >= SI4463_MIN_FRAME);
 }
 
 /*
@@ -203,5 +451,5 @@ uchar_t
 libradio_check_tx()
 {
 	libradio_get_fifo_info(0);
-	return(radio.tx_fifo >= SI4463_PACKET_LEN);
+	return(radio.tx_fifo >= SI4463_MAX_FRAME);
 }
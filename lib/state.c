@@ -70,23 +70,38 @@ libradio_get_my_channel()
 void
 libradio_set_state(uchar_t new_state)
 {
-	long ticks;
+	long ms, ticks;
 
 	if (new_state != LIBRADIO_STATE_STARTUP && radio.state == new_state)
 		return;
+	radio.link[LINK_STATE_CHANGES]++;
+	libradio_timer_cancel(LIBRADIO_TIMER_STATE);
 	libradio_set_song(new_state);
+#ifdef LIBRADIO_SNIFF
+	if (new_state != LIBRADIO_STATE_COLD && new_state != LIBRADIO_STATE_WARM)
+		libradio_sniff(0);
+#endif
 	switch (new_state) {
 	case LIBRADIO_STATE_COLD:
 	case LIBRADIO_STATE_WARM:
 		/*
 		 * Time to reduce power and wait for a while. Also turn off the real
 		 * time clock - no point trying to track the time in this mode. Wait
-		 * for 5 or 60 minutes depending.
+		 * for 5 or 60 minutes depending (on the state timer, so that
+		 * nothing else wakes us up early). The radio goes to sleep too, but
+		 * keeps its configuration for when we wake up. With LIBRADIO_SNIFF
+		 * it wakes up briefly every 31ms to check for traffic instead.
 		 */
+#ifdef LIBRADIO_SNIFF
+		libradio_sniff(1);
+#else
+		libradio_power_down();
+#endif
 		libradio_power_mode(0);
 		radio.tens_of_minutes = 0xff;
-		ticks = (new_state == LIBRADIO_STATE_WARM) ? 5*60*100L : 60*60*100L;
-		if ((ticks /= (long )radio.period) > 65535L)
+		ms = (new_state == LIBRADIO_STATE_WARM) ? LIBRADIO_WARM_TIMEOUT : LIBRADIO_COLD_TIMEOUT;
+		libradio_timer_arm(LIBRADIO_TIMER_STATE, ms);
+		if ((ticks = ms / 10 / (long )radio.period) > 65535L)
 			ticks = 65535L;
 		libradio_set_delay((int )ticks);
 		break;
@@ -112,9 +127,9 @@ libradio_set_state(uchar_t new_state)
 		radio.my_channel = 0;
 		radio.saw_rx = 0;
 		if (radio.state == LIBRADIO_STATE_COLD)
-			radio.timeout = 6000 / radio.fast_period;
+			libradio_timer_arm(LIBRADIO_TIMER_STATE, LIBRADIO_LISTEN_TIMEOUT);
 		else
-			radio.timeout = (int )(12000L / (long )radio.fast_period);
+			libradio_timer_arm(LIBRADIO_TIMER_STATE, 2 * LIBRADIO_LISTEN_TIMEOUT);
 		libradio_set_delay(500);
 		break;
 
@@ -128,11 +143,10 @@ libradio_set_state(uchar_t new_state)
 	default:
 		/*
 		 * All of the active states. The thing here is to rewind the RX
-		 * timeout for 60,000 passes through the loop (whatever that is
-		 * in seconds).
+		 * timeout (see libradio_rxloop()).
 		 */
 		libradio_power_mode(1);
-		radio.timeout = 6000;
+		libradio_timer_arm(LIBRADIO_TIMER_STATE, LIBRADIO_ACTIVE_TIMEOUT);
 		break;
 	}
 	radio.state = new_state;
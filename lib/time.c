@@ -35,21 +35,40 @@
  * intertwined with the real-time clock interrupts, the actual ISR is
  * part of this library rather than the application. It also manages to
  * flash the main LED with the appropriate indication of current state.
+ * Network time is picked up from received packets, in pkt_timesync().
  */
 #include <stdio.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 
 #include <libavr.h>
 
 #include "libradio.h"
 #include "internal.h"
 
+#ifdef LIBRADIO_DRIFT
+/*
+ * The start of the current drift measurement: when it was (in uptime
+ * ms), the time error left over after correcting the clock, the total
+ * of the corrections made since, and the number of steps slewed by
+ * clock_step() up to then. Also the last value saved in EEPROM.
+ */
+uchar_t		drift_based;
+uchar_t		drift_known;
+unsigned long	drift_start;
+long		drift_err;
+long		drift_steps;
+long		drift_slew;
+int			drift_saved;
+#endif
+
 /*
  * Return the millisecond ticks.
  */
 uint_t
 libradio_get_ticks()
 {
+	clock_sync();
 	return(radio.ms_ticks);
 }
 
@@ -59,5 +78,182 @@ libradio_get_ticks()
 uchar_t
 libradio_get_tom()
 {
+	clock_sync();
 	return(radio.tens_of_minutes);
 }
+
+/*
+ * Set the network time from a received packet. The packet time stamp
+ * was taken by the sender just before the transmission, so it arrived
+ * at the sync word TSYNC_TX_LATENCY later. If the radio IRQ gave us the
+ * time at the end of the frame, work back by the airtime of the rest of
+ * the frame to get our own clock at the sync word. The difference (in
+ * Timer1 counts) is the time error, and we correct the clock by that
+ * many whole ticks. This takes out any delay in getting around to
+ * reading the packet. Without a fresh time stamp, or if we don't know
+ * the time yet, we just copy the sender's time as before. Packets after
+ * the first in an aggregated frame are ignored.
+ */
+void
+pkt_timesync(struct packet *pp)
+{
+	int adj;
+	uint_t ticks, tcnt;
+	long err;
+
+	if (irq_stamped == 2)
+		return;
+	if (irq_stamped == 0 || radio.tens_of_minutes == 0xff) {
+		cli();
+		radio.ms_ticks = pp->ticks;
+		sei();
+#ifdef LIBRADIO_DRIFT
+		drift_based = 0;
+#endif
+		return;
+	}
+	/*
+	 * Our clock (in ticks) when the IRQ fired, then the difference to
+	 * the sender's clock, allowing for the ten-minute wrap.
+	 */
+	cli();
+	clock_credit();
+	ticks = radio.all_ticks - irq_ticks;
+	err = (long )radio.ms_ticks - (long )ticks * radio.period;
+	tcnt = irq_tcnt;
+	irq_stamped = 2;
+	sei();
+	err -= pp->ticks;
+	while (err > 30000L)
+		err -= 60000L;
+	while (err < -30000L)
+		err += 60000L;
+	err = err * TSYNC_TICK_COUNTS + (long )tcnt * radio.period;
+	err -= (long )TSYNC_BYTE_COUNTS * (TSYNC_FRAME_LEN + 2);
+	err -= TSYNC_TX_LATENCY(pp) + TSYNC_TICK_COUNTS / 2;
+	/*
+	 * Keep the stats and then fix our clock.
+	 */
+	if (err > 32767L)
+		radio.time_error = 32767;
+	else if (err < -32767L)
+		radio.time_error = -32767;
+	else
+		radio.time_error = err;
+	radio.time_nsync++;
+	if (radio.time_error > (int )radio.time_maxerr)
+		radio.time_maxerr = radio.time_error;
+	else if (-radio.time_error > (int )radio.time_maxerr)
+		radio.time_maxerr = -radio.time_error;
+	adj = (err + ((err < 0) ? -TSYNC_TICK_COUNTS/2 : TSYNC_TICK_COUNTS/2)) / TSYNC_TICK_COUNTS;
+	drift_update(err, adj);
+	if (adj == 0)
+		return;
+	cli();
+	clock_credit();
+	err = (long )radio.ms_ticks - adj;
+	if (err < 0)
+		err += 60000L;
+	else if (err >= 60000L)
+		err -= 60000L;
+	radio.ms_ticks = err;
+	sei();
+}
+
+/*
+ * Print the time synchronization stats. The errors are in Timer1 counts
+ * (4us at the normal clock rate).
+ */
+void
+libradio_time_stats(uchar_t clear)
+{
+	printf("TIME:N%u,E%d,M%u,D%d\n", radio.time_nsync, radio.time_error,
+					radio.time_maxerr, radio.time_drift);
+	if (clear) {
+		radio.time_nsync = radio.time_maxerr = 0;
+		radio.time_error = 0;
+	}
+}
+
+/*
+ * Load the drift estimate from EEPROM, if there's a sensible one there.
+ */
+void
+drift_init()
+{
+#ifdef LIBRADIO_DRIFT
+	int drift;
+
+	drift = eeprom_read_word((const uint_t *)LIBRADIO_DRIFT_EEPROM);
+	if (eeprom_read_word((const uint_t *)(LIBRADIO_DRIFT_EEPROM + 2)) != (uint_t )~drift ||
+				drift > DRIFT_MAX || drift < -DRIFT_MAX)
+		return;
+	radio.time_drift = drift_saved = drift;
+	drift_known = 1;
+#endif
+}
+
+/*
+ * A precise time sync measured our clock as err Timer1 counts ahead of
+ * the sender's, and we're about to step it back by adj ticks. Once the
+ * measurement has run for long enough, the growth in the error over
+ * the interval gives the drift. The steps taken along the way are added
+ * back, and so are those slewed by clock_step(). The slewing only drops
+ * a step every few minutes, so leaving it in would make each estimate
+ * swing by a step's worth. The interval is
+ * measured with the uptime, which doesn't wrap and keeps count across
+ * changes of clock speed. The first estimate is taken as it is, after
+ * that we only move half way, to smooth out the jitter. Anything wildly
+ * out is ignored.
+ */
+void
+drift_update(long err, int adj)
+{
+#ifdef LIBRADIO_DRIFT
+	unsigned long now, elapsed;
+	long growth, corr, slewed;
+
+	/*
+	 * The uptime when the packet arrived, and the steps slewed so far.
+	 */
+	cli();
+	clock_credit();
+	now = radio.uptime - (unsigned long )(uint_t )(radio.all_ticks - irq_ticks) * radio.period * 10;
+	slewed = slew_steps;
+	sei();
+	if (drift_based) {
+		elapsed = now - drift_start;
+		if (elapsed < DRIFT_MIN_TIME) {
+			drift_steps += (long )adj * TSYNC_TICK_COUNTS;
+			return;
+		}
+		growth = err - drift_err + drift_steps + (slewed - drift_slew) * TSYNC_TICK_COUNTS;
+		if (elapsed < DRIFT_MAX_TIME && growth < 32768L && growth > -32768L) {
+			corr = growth * (DRIFT_SLEW_UNIT / TSYNC_TICK_COUNTS) / (long )(elapsed / 10);
+			if (corr < DRIFT_MAX && corr > -DRIFT_MAX) {
+				if (drift_known)
+					corr = (corr + radio.time_drift) / 2;
+				if (corr > DRIFT_MAX)
+					corr = DRIFT_MAX;
+				else if (corr < -DRIFT_MAX)
+					corr = -DRIFT_MAX;
+				radio.time_drift = corr;
+				drift_known = 1;
+				if (corr - drift_saved >= DRIFT_SAVE_DELTA || drift_saved - corr >= DRIFT_SAVE_DELTA) {
+					eeprom_update_word((uint_t *)LIBRADIO_DRIFT_EEPROM, corr);
+					eeprom_update_word((uint_t *)(LIBRADIO_DRIFT_EEPROM + 2), ~corr);
+					drift_saved = corr;
+				}
+			}
+		}
+	}
+	/*
+	 * Start a new measurement from here.
+	 */
+	drift_based = 1;
+	drift_start = now;
+	drift_err = err - (long )adj * TSYNC_TICK_COUNTS;
+	drift_steps = 0;
+	drift_slew = slewed;
+#endif
+}
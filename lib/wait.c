@@ -48,10 +48,20 @@
 uchar_t		_irq_fired = 0;
 
 /*
- * Wait for the timer to tick, an interrupt from the radio, or some serial
- * I/O. The intent here is to slow down the processor and to reduce the
- * amount of power consumed. We put the processor to sleep, while we wait.
- * Returns a bitmask of reasons why it stopped waiting.
+ * When the radio last interrupted us, in clock ticks (all_ticks) and
+ * Timer1 counts within the tick. irq_stamped is 1 when there is a fresh
+ * time stamp, and 2 once it has been used (see pkt_timesync()).
+ */
+uint_t		irq_ticks;
+uint_t		irq_tcnt;
+uchar_t		irq_stamped;
+
+/*
+ * Wait for the timer to tick, an interrupt from the radio, some serial
+ * I/O, the completion of an SPI transaction, a deadline timer or a
+ * posted event. The intent here is to slow down the processor and to
+ * reduce the amount of power consumed. We put the processor to sleep,
+ * while we wait. Returns a bitmask of reasons why it stopped waiting.
  */
 uchar_t
 libradio_wait()
@@ -60,12 +70,20 @@ libradio_wait()
 
 	while (status == 0) {
 		_watchdog();
-		if (_irq_fired)
+		if (_irq_fired && !libradio_tx_intr())
 			status |= LIBRADIO_WAIT_RXINT;
 		if (libradio_tick_wait())
 			status |= LIBRADIO_WAIT_TIMER;
+		if (libradio_timer_wait())
+			status |= LIBRADIO_WAIT_DEADLINE;
 		if (!sio_iqueue_empty())
 			status |= LIBRADIO_WAIT_SERIAL;
+		if (pkt_done) {
+			pkt_done = 0;
+			status |= LIBRADIO_WAIT_SPI;
+		}
+		if (event_posted)
+			status |= LIBRADIO_WAIT_POSTED;
 		if (status)
 			break;
 		_sleep();
@@ -96,11 +114,25 @@ libradio_irq_enable(uchar_t flag)
 		/*
 		 * Enable INT0
 		 */
+		if (_irq_fired)
+			radio.link[LINK_IRQS]++;
 		_irq_fired = 0;
 		EIMSK |= 01;
 	}
 }
 
+/*
+ * Called from the radio IRQ to note the time. If the clock tick is due
+ * but hasn't been serviced yet (we're in a higher priority interrupt),
+ * then clock_counts() allows for it.
+ */
+void
+radio_stamp()
+{
+	irq_tcnt = clock_counts(&irq_ticks);
+	irq_stamped = 1;
+}
+
 /*
  * Return the status of the _irq_fired bit
  */
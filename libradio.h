@@ -36,7 +36,17 @@
  */
 #define MAX_FIFO_SIZE		48
 #define MAX_PACKET_SIZE		16
-#define PACKET_HEADER_LEN	6
+#ifdef LIBRADIO_HWCRC
+#define PACKET_CSUM_LEN		0
+#else
+#define PACKET_CSUM_LEN		1
+#endif
+#ifdef LIBRADIO_RELIABLE
+#define PACKET_SEQ_LEN		1
+#else
+#define PACKET_SEQ_LEN		0
+#endif
+#define PACKET_HEADER_LEN	(5 + PACKET_CSUM_LEN + PACKET_SEQ_LEN)
 #define MAX_PAYLOAD_SIZE	(MAX_PACKET_SIZE - PACKET_HEADER_LEN)
 
 /*
@@ -65,6 +75,8 @@
 #define RADIO_CMD_WRITE_EEPROM		8
 #define RADIO_STATUS_RESPONSE		9
 #define RADIO_EEPROM_RESPONSE		10
+#define RADIO_CMD_ACK				11
+#define RADIO_CMD_FRAGMENT			12
 
 #define RADIO_CMD_ADDITIONAL_BASE	16
 
@@ -92,6 +104,19 @@
 #define RADIO_STATUS_USER2			4
 #define RADIO_STATUS_USER3			5
 
+/*
+ * Status types 8 to 15 belong to the library, and are answered by it
+ * rather than by fetch_status(). The application can use 2 to 7 (and
+ * anything above 15) for its own status blocks.
+ */
+#define RADIO_STATUS_LIBRARY_BASE	8
+#define RADIO_STATUS_NLIBRARY		8
+
+#define RADIO_STATUS_TRACE			8
+#define RADIO_STATUS_LINK			9
+#define RADIO_STATUS_NLINK			6
+#define RADIO_STATUS_OTA			15
+
 #define RADIO_CTLERR_INVALID_CHANNEL	1
 #define RADIO_CTLERR_BUSY				2
 #define RADIO_CTLERR_TOO_MUCH_DATA		3
@@ -111,7 +136,11 @@
  * We allow for a maximum of 10 bytes of actual payload data. This is
  * because the maximum packet size is 16 bytes, there are three "magic"
  * bytes sent during every transmission (myticks & cksum), and there
- * are three header bytes in the packet.
+ * are three header bytes in the packet. With LIBRADIO_HWCRC, the radio
+ * CRC-16 is trusted instead, the checksum byte goes away and there are
+ * 11 bytes of payload. With LIBRADIO_RELIABLE, a sequence byte costs one
+ * byte of payload. A non-zero sequence number marks a unicast packet
+ * from the controller, and the top bit asks for a RADIO_CMD_ACK.
  */
 typedef unsigned short ushort;
 struct packet	{
@@ -119,18 +148,78 @@ struct packet	{
 	uchar_t		node;		/* ID for receiver (0 is a broadcast) */
 	uchar_t		cmd;		/* Command for the receiver */
 	uchar_t		len;		/* Length of the data payload */
+#ifndef LIBRADIO_HWCRC
 	uchar_t		csum;		/* Checksum for the overall packet */
+#endif
+#ifdef LIBRADIO_RELIABLE
+	uchar_t		seq;		/* Sequence number (0 if none) */
+#endif
 	uchar_t		data[MAX_PAYLOAD_SIZE];
 };
 
+#define RADIO_SEQ_MASK			0x7f
+#define RADIO_SEQ_ACKREQ		0x80
+
+/*
+ * With LIBRADIO_FRAG, anything too big for one packet is sent as a
+ * series of (up to eight) RADIO_CMD_FRAGMENT packets, each with a
+ * two-byte fragment header. The largest payload which can be sent this
+ * way is LIBRADIO_FRAG_MAX. The reassembled packet has the original
+ * command and length, and data which runs on past the end of the packet
+ * structure (see frag.c). Without it, nothing bigger than a packet
+ * payload can be sent.
+ */
+#ifdef LIBRADIO_FRAG
+#ifndef LIBRADIO_FRAG_MAX
+#define LIBRADIO_FRAG_MAX		32
+#endif
+#else
+#undef LIBRADIO_FRAG_MAX
+#define LIBRADIO_FRAG_MAX		MAX_PAYLOAD_SIZE
+#endif
+#define FRAG_HEADER_LEN			2
+#define FRAG_CHUNK				(MAX_PAYLOAD_SIZE - FRAG_HEADER_LEN)
+#define FRAG_MAX_FRAGS			8
+
+/*
+ * Over-the-air firmware updates (LIBRADIO_OTA). The first byte of a
+ * RADIO_CMD_FIRMWARE payload is the operation, and for RADIO_OTA_DATA
+ * the bottom five bits are the chunk number within the page. The new
+ * image is sent a flash page at a time, in OTA_NCHUNKS chunks of
+ * OTA_CHUNK bytes (the last one may be shorter). See COMMANDS.md.
+ */
+#define RADIO_OTA_BEGIN			0x00
+#define RADIO_OTA_DATA			0x20
+#define RADIO_OTA_COMMIT		0x40
+#define RADIO_OTA_FINISH		0x60
+#define RADIO_OTA_ABORT			0x80
+#define RADIO_OTA_OP_MASK		0xe0
+#define RADIO_OTA_CHUNK_MASK	0x1f
+
+#define RADIO_OTA_IDLE			0
+#define RADIO_OTA_LOADING		1
+#define RADIO_OTA_READY			2
+#define RADIO_OTA_FAILED		3
+
+#define OTA_PAGE_SIZE			128
+#define OTA_HEADER_LEN			2
+#define OTA_CHUNK				(MAX_PAYLOAD_SIZE - OTA_HEADER_LEN)
+#define OTA_NCHUNKS				((OTA_PAGE_SIZE + OTA_CHUNK - 1) / OTA_CHUNK)
+
 /*
  * Normal receivers just have a single channel entry, but the transmitter can
- * have multiple. One for every transmitting frequency in use.
+ * have multiple. One for every transmitting frequency in use. Additional
+ * packets for the same channel are chained on via the next pointer and
+ * (in variable-length mode) are sent in the same over-the-air frame.
+ * The controller counts the attempts at sending a reliable packet in
+ * tries (see LIBRADIO_RELIABLE). It's zero for anything else.
  */
 struct channel	{
 	uchar_t		state;
 	uchar_t		priority;
+	uchar_t		tries;
 	struct packet	packet;
+	struct channel	*next;
 };
 
 /*
@@ -149,10 +238,32 @@ struct channel	{
 #define LIBRADIO_CHSTATE_RXRESPONSE2	7
 #define LIBRADIO_CHSTATE_RXRESPONSE3	8
 #define LIBRADIO_CHSTATE_RXRESPONSE4	9
+#define LIBRADIO_CHSTATE_TXRELIABLE		10
 
 #define LIBRADIO_WAIT_RXINT				01
 #define LIBRADIO_WAIT_SERIAL			02
 #define LIBRADIO_WAIT_TIMER				04
+#define LIBRADIO_WAIT_SPI				010
+#define LIBRADIO_WAIT_DEADLINE			020
+#define LIBRADIO_WAIT_POSTED			040
+#define LIBRADIO_WAIT_ALL				077
+
+/*
+ * Number of handler slots in the event scheduler (see event.c).
+ */
+#ifndef LIBRADIO_NEVENTS
+#define LIBRADIO_NEVENTS				6
+#endif
+
+/*
+ * Deadline timers (see clock.c). Timer 0 is used by the library for the
+ * state timeouts, and the rest are free for the application.
+ */
+#ifndef LIBRADIO_NTIMERS
+#define LIBRADIO_NTIMERS				4
+#endif
+#define LIBRADIO_TIMER_STATE			0
+#define LIBRADIO_TIMER_USER				1
 
 extern	volatile uchar_t	main_thread;
 
@@ -169,24 +280,47 @@ uint_t	libradio_get_delay();
 void	libradio_set_delay(uint_t);
 int		libradio_tick_wait();
 int		libradio_elapsed_second();
+unsigned long	libradio_uptime();
+void	libradio_timer_arm(uchar_t, unsigned long);
+void	libradio_timer_cancel(uchar_t);
+uchar_t	libradio_timer_expired(uchar_t);
+long	libradio_timer_next();
+int		libradio_timer_wait();
 uchar_t	libradio_recv_start();
 void	libradio_rxloop();
+void	libradio_rxevent(uchar_t);
+void	libradio_event_add(uchar_t, uchar_t, void (*)(uchar_t));
+void	libradio_event_post(uchar_t);
+void	libradio_event_run();
 void	libradio_command(struct packet *);
+uchar_t	libradio_frag_count(uchar_t);
+uchar_t	libradio_frag_tag();
+uchar_t	libradio_frag_pack(uchar_t [], uchar_t, uchar_t, uchar_t [], uchar_t, uchar_t);
+struct packet	*libradio_frag_rx(struct packet *);
 uchar_t	libradio_wait();
 
 uchar_t	libradio_recv(struct channel *, uchar_t);
+uchar_t	libradio_recv_burst(struct channel [], uchar_t, uchar_t);
 uchar_t	libradio_send(struct channel *, uchar_t);
 int		libradio_power_up();
 void	libradio_power_down();
+void	libradio_sniff(uchar_t);
 uint_t	libradio_get_ticks();
 uchar_t	libradio_get_tom();
 
 void	libradio_set_rx(uchar_t);
+uchar_t	libradio_rx_hop(uchar_t);
+void	libradio_set_filter(uchar_t);
+void	libradio_set_cca_threshold(uchar_t);
 uchar_t	libradio_check_rx();
 uchar_t	libradio_check_tx();
 int		libradio_request_device_status();
+uchar_t	libradio_read_frr();
+void	libradio_clear_int();
 void	libradio_get_property(uint_t, uchar_t);
-void	libradio_set_property();
+void	libradio_set_property(uint_t, uchar_t);
+void	libradio_prop_flush();
+int		libradio_prop_value(uint_t);
 void	libradio_get_part_info();
 void	libradio_get_func_info();
 int		libradio_get_packet_info();
@@ -199,6 +333,9 @@ void	libradio_change_radio_state(uchar_t);
 uchar_t	libradio_get_fifo_info(uchar_t);
 void	libradio_get_int_status();
 void	libradio_handle_packet();
+void	libradio_dispatch();
+uchar_t	libradio_rxq_depth();
+int		libradio_link_status(uchar_t, uchar_t [], int);
 uchar_t	libradio_irq_fired();
 void	libradio_debug();
 
@@ -88,6 +88,7 @@ void		parse_data(char *);
 int			crack(char *, char *[], int, int);
 
 void		response(int, int, int, char *);
+void		ack_response(int, int, int, char *);
 void		local_activate();
 void		client_activate(int[], int);
 void		request_local_status(int);
@@ -115,3 +116,8 @@ void		sio_close();
 
 void		rmq_init(char *);
 void		rmq_publish(char *);
+
+void		ota_init(char *, int, char *, char *);
+void		ota_start();
+int			ota_reply(int);
+int			ota_response(int, int, char *);
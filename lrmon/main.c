@@ -56,8 +56,8 @@ void	usage();
 int
 main(int argc, char *argv[])
 {
-	int i, speed;
-	char *device, *rmqhost;
+	int i, speed, ota_chan;
+	char *device, *rmqhost, *ota_file, *ota_cat, *ota_nodes;
 
 	/*
 	 * Process the CLI options.
@@ -65,7 +65,9 @@ main(int argc, char *argv[])
 	speed = 38400;
 	device = "/dev/ttyUSB0";
 	rmqhost = strdup("localhost:5672");
-	while ((i = getopt(argc, argv, "r:s:l:")) != EOF) {
+	ota_file = ota_cat = ota_nodes = NULL;
+	ota_chan = 0;
+	while ((i = getopt(argc, argv, "r:s:l:u:c:k:n:")) != EOF) {
 		switch (i) {
 		case 'r':
 			rmqhost = optarg;
@@ -80,12 +82,32 @@ main(int argc, char *argv[])
 			device = optarg;
 			break;
 
+		case 'u':
+			ota_file = optarg;
+			break;
+
+		case 'c':
+			ota_chan = atoi(optarg);
+			break;
+
+		case 'k':
+			ota_cat = optarg;
+			break;
+
+		case 'n':
+			ota_nodes = optarg;
+			break;
+
 		default:
 			usage();
 		}
 	}
+	if (ota_file != NULL && (ota_cat == NULL || ota_nodes == NULL))
+		usage();
 	openlog("lrmond", LOG_PID, LOG_USER);
 	syslog(LOG_INFO, "Local radio control/monitoring service started.");
+	if (ota_file != NULL)
+		ota_init(ota_file, ota_chan, ota_cat, ota_nodes);
 	maxfd = 0;
 	FD_ZERO(&mrfds);
 	timer_init();
@@ -145,6 +167,8 @@ parse_data(char *data)
 	data++;
 	if (*data == '+') {
 		syslog(LOG_DEBUG, "GOOD RESPONSE!!!!\n");
+		if (ota_reply(0))
+			return;
 		failure_status = 0;
 		state_machine();
 		return;
@@ -161,6 +185,8 @@ parse_data(char *data)
 		else
 			node = 0;
 		syslog(LOG_DEBUG, "FAILURE CODE %d (radio status %d)\n", failure_status, node);
+		if (ota_reply(failure_status))
+			return;
 		state_machine();
 		return;
 	}
@@ -191,6 +217,10 @@ parse_data(char *data)
 		state_machine();
 		break;
 
+	case RADIO_CMD_ACK:
+		ack_response(chan, node, ticks, args[3]);
+		break;
+
 	default:
 		syslog(LOG_ERR, "Unknown command/response.\n");
 		syslog(LOG_ERR, "RCVD: Chan %d, node %d, ticks %d, cmd %d, args [%s]\n", chan, node, ticks, cmd, args[3]);
@@ -225,6 +255,6 @@ crack(char *line, char *argv[], int nargs, int delim)
 void
 usage()
 {
-	fprintf(stderr, "Usage: lrmon -s 38400 -l /dev/ttyUSB0\n");
+	fprintf(stderr, "Usage: lrmon -s 38400 -l /dev/ttyUSB0 [-u image.bin -c chan -k c1,c2 -n node,...]\n");
 	exit(2);
 }
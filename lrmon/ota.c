@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2024, Kalopa Robotics Limited.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * The sending half of an over-the-air firmware update (see
+ * RADIO_CMD_FIRMWARE in COMMANDS.md). The image is read from a binary
+ * file at startup, and once the controller is up and running it is
+ * broadcast to every client of the given category on the channel. Each
+ * command is sent when the controller has accepted the last one, and a
+ * busy controller is tried again a second later.
+ *
+ * After the image has been streamed, each of the listed nodes is asked
+ * for status block RADIO_STATUS_OTA. The chunks which any of them are
+ * missing are sent again (as a broadcast), and the nodes are polled
+ * again, until they are all ready or we run out of rounds. A node which
+ * never heard the BEGIN is sent its own, and the whole image. Then a
+ * broadcast RADIO_OTA_FINISH installs it everywhere. The time from the
+ * BEGIN until every node was ready, the time-to-update for all N
+ * nodes, is logged and published along with each node's own figure.
+ *
+ * The chunk size depends on the library build options, so lrmon has to
+ * be built with the same OPTS as the clients.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "lrmon.h"
+#include "libradio.h"
+
+/*
+ * Must match OTA_MAX_PAGES in lib/internal.h.
+ */
+#define OTA_MAX_PAGES		126
+#define OTA_ALL_CHUNKS		((1UL << OTA_NCHUNKS) - 1)
+#define OTA_MAX_NODES		64
+#define OTA_MAX_ROUNDS		20
+#define OTA_POLL_TRIES		5
+#define OTA_POLL_WAIT		3
+#define OTA_SEND_TRIES		10
+#define OTA_FINISH_REPEAT	3
+
+#define OTA_PHASE_IDLE		0
+#define OTA_PHASE_BEGIN		1
+#define OTA_PHASE_SEND		2
+#define OTA_PHASE_POLL		3
+#define OTA_PHASE_FINISH	4
+#define OTA_PHASE_DONE		5
+
+/*
+ * What we know about each node. The state is the client's own update
+ * state (RADIO_OTA_{x}), or -1 if it hasn't answered. Elapsed is the
+ * client's time-to-update in tenths of a second. A node which doesn't
+ * answer any of its status requests is lost, and isn't waited for.
+ */
+struct ota_node	{
+	int				node;
+	int				state;
+	int				ndone;
+	int				want;
+	unsigned long	missing;
+	int				elapsed;
+	int				begin;
+	int				lost;
+};
+
+/*
+ * The update. The image, its size and CRC, which chunks of each page
+ * still have to be sent (and whether the page needs a commit), and
+ * where we are in sending them.
+ */
+struct ota	{
+	int				phase;
+	int				chan;
+	int				c1, c2;
+	int				npages;
+	int				crc;
+	uchar_t			image[OTA_MAX_PAGES * OTA_PAGE_SIZE];
+	unsigned long	resend[OTA_MAX_PAGES];
+	char			commit[OTA_MAX_PAGES];
+	int				page;
+	int				chunk;
+	int				nnodes;
+	struct ota_node	nodes[OTA_MAX_NODES];
+	int				curr;
+	int				tries;
+	int				ptries;
+	int				waiting;
+	int				round;
+	int				finish;
+	int				packets;
+	time_t			start;
+	time_t			elapsed;
+	int				dlen;
+	int				data[MAX_PAYLOAD_SIZE];
+	int				dnode;
+};
+
+struct ota	ota;
+
+void	ota_begin(int);
+void	ota_send();
+void	ota_retry();
+void	ota_next();
+void	ota_poll_next();
+void	ota_poll();
+void	ota_poll_timeout();
+void	ota_round();
+void	ota_report();
+int		ota_crc(int, uchar_t);
+
+/*
+ * Load the image to be sent, and the list of nodes which are to be
+ * updated. The image is a raw binary (avr-objcopy -O binary), and is
+ * padded out to a whole number of pages with 0xff.
+ */
+void
+ota_init(char *file, int chan, char *category, char *nodes)
+{
+	int i, n;
+	char *args[OTA_MAX_NODES];
+	FILE *fp;
+
+	memset(&ota, 0, sizeof(ota));
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	memset(ota.image, 0xff, sizeof(ota.image));
+	n = fread(ota.image, 1, sizeof(ota.image), fp);
+	if (n == sizeof(ota.image) && getc(fp) != EOF) {
+		fprintf(stderr, "lrmon: %s: image too big for OTA\n", file);
+		exit(1);
+	}
+	fclose(fp);
+	if (n == 0) {
+		fprintf(stderr, "lrmon: %s: empty image\n", file);
+		exit(1);
+	}
+	ota.npages = (n + OTA_PAGE_SIZE - 1) / OTA_PAGE_SIZE;
+	ota.crc = 0xffff;
+	for (i = 0; i < ota.npages * OTA_PAGE_SIZE; i++)
+		ota.crc = ota_crc(ota.crc, ota.image[i]);
+	if (chan < 0 || chan > 7 || crack(category, args, 2, ',') != 2) {
+		fprintf(stderr, "lrmon: invalid OTA channel or category\n");
+		exit(1);
+	}
+	ota.chan = chan;
+	ota.c1 = atoi(args[0]);
+	ota.c2 = atoi(args[1]);
+	n = crack(nodes, args, OTA_MAX_NODES, ',');
+	for (i = 0; i < n; i++) {
+		if ((ota.nodes[i].node = atoi(args[i])) < 2 || ota.nodes[i].node > 255) {
+			fprintf(stderr, "lrmon: invalid OTA node '%s'\n", args[i]);
+			exit(1);
+		}
+	}
+	ota.nnodes = n;
+	ota.phase = OTA_PHASE_IDLE;
+	syslog(LOG_INFO, "OTA image %s: %d pages, CRC %04x, %d nodes", file, ota.npages, ota.crc, ota.nnodes);
+}
+
+/*
+ * The controller is ready. Start the update, if there is one.
+ */
+void
+ota_start()
+{
+	int i;
+
+	if (ota.npages == 0 || ota.phase != OTA_PHASE_IDLE)
+		return;
+	for (i = 0; i < ota.nnodes; i++) {
+		ota.nodes[i].state = -1;
+		ota.nodes[i].lost = 0;
+	}
+	for (i = 0; i < ota.npages; i++) {
+		ota.resend[i] = OTA_ALL_CHUNKS;
+		ota.commit[i] = 1;
+	}
+	ota.page = ota.chunk = 0;
+	ota.round = ota.packets = 0;
+	time(&ota.start);
+	ota.phase = OTA_PHASE_BEGIN;
+	syslog(LOG_INFO, "OTA update started.");
+	ota_begin(0);
+}
+
+/*
+ * Send a RADIO_OTA_BEGIN to the node (or broadcast it).
+ */
+void
+ota_begin(int node)
+{
+	ota.dnode = node;
+	ota.data[0] = RADIO_OTA_BEGIN;
+	ota.data[1] = ota.c1;
+	ota.data[2] = ota.c2;
+	ota.data[3] = ota.npages;
+	ota.data[4] = (ota.crc >> 8) & 0xff;
+	ota.data[5] = ota.crc & 0xff;
+	ota.dlen = 6;
+	ota_send();
+}
+
+/*
+ * Send the command we have ready, and wait for the controller to say
+ * whether it took it.
+ */
+void
+ota_send()
+{
+	ota.waiting = 1;
+	ota.packets++;
+	send_command(ota.chan, ota.dnode, RADIO_CMD_FIRMWARE, ota.data, ota.dlen);
+}
+
+/*
+ * The controller has replied to a command. If it was one of ours, move
+ * on to the next (or try again later, if the controller was too busy).
+ * Returns zero if the reply wasn't ours.
+ */
+int
+ota_reply(int code)
+{
+	if (ota.waiting == 0)
+		return(0);
+	ota.waiting = 0;
+	if (code != 0) {
+		syslog(LOG_DEBUG, "OTA command refused (%d)\n", code);
+		if (++ota.tries > OTA_SEND_TRIES) {
+			syslog(LOG_ERR, "OTA update abandoned, controller not responding.");
+			ota.elapsed = time(NULL) - ota.start;
+			ota.phase = OTA_PHASE_DONE;
+			ota_report();
+			return(1);
+		}
+		ota.packets--;
+		timer_insert(ota_retry, 1);
+		return(1);
+	}
+	ota.tries = 0;
+	if (ota.phase == OTA_PHASE_POLL) {
+		/*
+		 * The status request is queued. Give the node time to answer.
+		 */
+		timer_insert(ota_poll_timeout, OTA_POLL_WAIT);
+		return(1);
+	}
+	ota_next();
+	return(1);
+}
+
+/*
+ * Try the last command again.
+ */
+void
+ota_retry()
+{
+	if (ota.phase == OTA_PHASE_POLL)
+		ota_poll();
+	else
+		ota_send();
+}
+
+/*
+ * Work out the next command to send. Each page with chunks to be sent
+ * is followed by its commit. Once they're all gone, poll the nodes.
+ */
+void
+ota_next()
+{
+	int i, n, off;
+
+	switch (ota.phase) {
+	case OTA_PHASE_BEGIN:
+	case OTA_PHASE_SEND:
+		ota.phase = OTA_PHASE_SEND;
+		ota.dnode = 0;
+		for (i = 0; i < ota.nnodes; i++) {
+			if (ota.nodes[i].begin) {
+				/*
+				 * This one missed the BEGIN. Send it one of its own.
+				 */
+				ota.nodes[i].begin = 0;
+				ota_begin(ota.nodes[i].node);
+				return;
+			}
+		}
+		for (; ota.page < ota.npages; ota.page++, ota.chunk = 0) {
+			for (; ota.chunk < OTA_NCHUNKS; ota.chunk++) {
+				if ((ota.resend[ota.page] & (1UL << ota.chunk)) == 0)
+					continue;
+				ota.resend[ota.page] &= ~(1UL << ota.chunk);
+				off = ota.chunk * OTA_CHUNK;
+				if ((n = OTA_PAGE_SIZE - off) > OTA_CHUNK)
+					n = OTA_CHUNK;
+				ota.data[0] = RADIO_OTA_DATA | ota.chunk;
+				ota.data[1] = ota.page;
+				for (i = 0; i < n; i++)
+					ota.data[OTA_HEADER_LEN + i] = ota.image[ota.page * OTA_PAGE_SIZE + off + i];
+				ota.dlen = n + OTA_HEADER_LEN;
+				ota_send();
+				return;
+			}
+			if (ota.commit[ota.page]) {
+				ota.commit[ota.page] = 0;
+				n = 0xffff;
+				for (i = 0; i < OTA_PAGE_SIZE; i++)
+					n = ota_crc(n, ota.image[ota.page * OTA_PAGE_SIZE + i]);
+				ota.data[0] = RADIO_OTA_COMMIT;
+				ota.data[1] = ota.page;
+				ota.data[2] = (n >> 8) & 0xff;
+				ota.data[3] = n & 0xff;
+				ota.dlen = 4;
+				ota_send();
+				return;
+			}
+		}
+		/*
+		 * Everything has been sent. See who's missing what.
+		 */
+		ota.phase = OTA_PHASE_POLL;
+		ota.curr = -1;
+		ota_poll_next();
+		break;
+
+	case OTA_PHASE_FINISH:
+		if (++ota.finish < OTA_FINISH_REPEAT) {
+			ota_send();
+			break;
+		}
+		ota.phase = OTA_PHASE_DONE;
+		ota_report();
+		break;
+	}
+}
+
+/*
+ * Ask the next node which hasn't got the whole image for its status.
+ * Once they've all been asked, work out what to do next.
+ */
+void
+ota_poll_next()
+{
+	struct ota_node *np;
+
+	for (ota.curr++; ota.curr < ota.nnodes; ota.curr++) {
+		np = &ota.nodes[ota.curr];
+		if (np->state != RADIO_OTA_READY && np->state != RADIO_OTA_FAILED && !np->lost) {
+			ota.ptries = 0;
+			ota_poll();
+			return;
+		}
+	}
+	ota_round();
+}
+
+/*
+ * Send a status request to the current node.
+ */
+void
+ota_poll()
+{
+	ota.waiting = 1;
+	ota.packets++;
+	request_client_status(ota.chan, ota.nodes[ota.curr].node, RADIO_STATUS_OTA);
+}
+
+/*
+ * The node didn't answer. Ask again, or give up on it.
+ */
+void
+ota_poll_timeout()
+{
+	if (ota.phase != OTA_PHASE_POLL)
+		return;
+	if (++ota.ptries < OTA_POLL_TRIES) {
+		ota_poll();
+		return;
+	}
+	syslog(LOG_INFO, "OTA node %d not answering.", ota.nodes[ota.curr].node);
+	ota.nodes[ota.curr].lost = 1;
+	ota_poll_next();
+}
+
+/*
+ * A status response from a client. If it's the RADIO_STATUS_OTA we
+ * asked for, note what the node is missing and move on to the next.
+ * Returns zero if the response wasn't ours.
+ */
+int
+ota_response(int chan, int node, char *argp)
+{
+	int i, idata[10];
+	char *data[10];
+	struct ota_node *np;
+
+	if (ota.phase != OTA_PHASE_POLL || chan != ota.chan || ota.curr >= ota.nnodes)
+		return(0);
+	np = &ota.nodes[ota.curr];
+	if (node != np->node || crack(argp, data, 10, ',') != 10)
+		return(0);
+	for (i = 0; i < 10; i++)
+		idata[i] = atoi(data[i]);
+	if (idata[0] != RADIO_STATUS_OTA)
+		return(0);
+	timer_remove(ota_poll_timeout);
+	np->state = idata[1];
+	np->ndone = idata[2];
+	np->want = idata[3];
+	np->missing = ((unsigned long )idata[4] << 24) | (idata[5] << 16) | (idata[6] << 8) | idata[7];
+	np->elapsed = (idata[8] << 8) | idata[9];
+	syslog(LOG_DEBUG, "OTA node %d: state %d, %d/%d pages, want %d (%lx)\n",
+			node, np->state, np->ndone, ota.npages, np->want, np->missing);
+	ota_poll_next();
+	return(1);
+}
+
+/*
+ * Every node has been polled. If they all have the image, install it.
+ * Otherwise mark whatever is missing to be sent again, and go round
+ * once more. The status block only says which chunks are missing from
+ * the first page a node still needs. Unless its page count says that's
+ * the only one, we don't know which of the later pages it has, so they
+ * are sent again in full.
+ */
+void
+ota_round()
+{
+	int i, page, pending = 0, ready = 0;
+	struct ota_node *np;
+
+	for (i = 0; i < ota.nnodes; i++) {
+		np = &ota.nodes[i];
+		if (np->lost)
+			continue;
+		switch (np->state) {
+		case RADIO_OTA_READY:
+			ready++;
+			break;
+
+		case RADIO_OTA_FAILED:
+			break;
+
+		case RADIO_OTA_IDLE:
+			np->begin = 1;
+			for (page = 0; page < ota.npages; page++) {
+				ota.resend[page] = OTA_ALL_CHUNKS;
+				ota.commit[page] = 1;
+			}
+			pending++;
+			break;
+
+		case RADIO_OTA_LOADING:
+			if (np->want >= ota.npages)
+				break;
+			ota.resend[np->want] |= (np->missing & OTA_ALL_CHUNKS);
+			ota.commit[np->want] = 1;
+			if (np->ndone < ota.npages - 1) {
+				for (page = np->want + 1; page < ota.npages; page++) {
+					ota.resend[page] = OTA_ALL_CHUNKS;
+					ota.commit[page] = 1;
+				}
+			}
+			pending++;
+			break;
+
+		default:
+			pending++;
+			break;
+		}
+	}
+	syslog(LOG_INFO, "OTA round %d: %d of %d nodes ready.", ota.round, ready, ota.nnodes);
+	if (pending > 0 && ++ota.round <= OTA_MAX_ROUNDS) {
+		ota.phase = OTA_PHASE_SEND;
+		ota.page = ota.chunk = 0;
+		ota_next();
+		return;
+	}
+	ota.elapsed = time(NULL) - ota.start;
+	if (ready == 0) {
+		ota.phase = OTA_PHASE_DONE;
+		ota_report();
+		return;
+	}
+	/*
+	 * Install it on the ones which are ready. Anyone else is left
+	 * running the old code.
+	 */
+	ota.phase = OTA_PHASE_FINISH;
+	ota.finish = 0;
+	ota.dnode = 0;
+	ota.data[0] = RADIO_OTA_FINISH;
+	ota.data[1] = (ota.crc >> 8) & 0xff;
+	ota.data[2] = ota.crc & 0xff;
+	ota.dlen = 3;
+	ota_send();
+}
+
+/*
+ * Log how the update went, and pass it on to any interested parties.
+ * The time-to-update is from the BEGIN until every node was ready.
+ */
+void
+ota_report()
+{
+	int i, ready = 0;
+	char json[128];
+	struct ota_node *np;
+
+	for (i = 0; i < ota.nnodes; i++) {
+		np = &ota.nodes[i];
+		if (np->state == RADIO_OTA_READY) {
+			ready++;
+			syslog(LOG_INFO, "OTA node %d updated (%d.%ds).", np->node, np->elapsed / 10, np->elapsed % 10);
+		} else
+			syslog(LOG_INFO, "OTA node %d NOT updated (state %d, %d/%d pages).",
+						np->node, np->state, np->ndone, ota.npages);
+	}
+	syslog(LOG_INFO, "OTA update of %d/%d nodes took %lds, %d rounds, %d commands.",
+				ready, ota.nnodes, (long )ota.elapsed, ota.round, ota.packets);
+	sprintf(json, "{\"ota\":{\"pages\":%d,\"nodes\":%d,\"ready\":%d,\"seconds\":%ld,\"rounds\":%d,\"packets\":%d}}",
+			ota.npages, ota.nnodes, ready, (long )ota.elapsed, ota.round, ota.packets);
+	rmq_publish(json);
+}
+
+/*
+ * CRC-16/CCITT, the same as _crc_ccitt_update() in avr-libc.
+ */
+int
+ota_crc(int crc, uchar_t data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return((((data << 8) | ((crc >> 8) & 0xff)) ^ (data >> 4) ^ (data << 3)) & 0xffff);
+}
@@ -76,6 +76,29 @@ response(int chan, int node, int ticks, char *argp)
 	 */
 	if (node < 2)
 		local_response(argp);
+	else
+		ota_response(chan, node, argp);
+}
+
+/*
+ * The controller has finished with a reliable packet (see
+ * LIBRADIO_RELIABLE). The data is the delivery flag, the command and
+ * the number of tries. Pass it on to any interested parties.
+ */
+void
+ack_response(int chan, int node, int ticks, char *argp)
+{
+	char *json;
+
+	syslog(LOG_DEBUG, "Delivery report from channel %d, node %d / [%s]\n", chan, node, argp);
+	if ((json = (char *)malloc(strlen(argp) + 64)) == NULL) {
+		syslog(LOG_ERR, "malloc failure in delivery report");
+		exit(1);
+	}
+	sprintf(json, "{\"chan\":%d,\"node\":%d,\"cmd\":%d,\"ticks\":%d,\"data\":[%s]}",
+			chan, node, RADIO_CMD_ACK, ticks, argp);
+	rmq_publish(json);
+	free(json);
 }
 
 /*
@@ -112,4 +135,10 @@ local_response(char *argp)
 			dstatus.battery_voltage,
 			dstatus.npacket_rx, dstatus.npacket_tx);
 	}
+	if (idata[0] >= RADIO_STATUS_LINK && idata[0] < RADIO_STATUS_LINK + RADIO_STATUS_NLINK && n == 9) {
+		syslog(LOG_DEBUG, "Local link response %d: %lu, %lu\n",
+			idata[0] - RADIO_STATUS_LINK,
+			((unsigned long )idata[1] << 24) | (idata[2] << 16) | (idata[3] << 8) | idata[4],
+			((unsigned long )idata[5] << 24) | (idata[6] << 16) | (idata[7] << 8) | idata[8]);
+	}
 }
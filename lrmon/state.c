@@ -198,6 +198,7 @@ state_machine()
 			state = STATE_READY;
 			syslog(LOG_INFO, "Communications channels are open and working.");
 			dynamic_status_timer();
+			ota_start();
 			break;
 		}
 		failure_status = -1;
@@ -43,7 +43,7 @@
 #define FW_VERSION_H	0
 #define FW_VERSION_L	1
 
-struct channel	recvchan;
+struct channel	recvchan[SI4463_FIFO_PACKETS];
 
 /*
  * Prototypes
@@ -74,8 +74,7 @@ mysetup()
 int
 main()
 {
-	int irqf;
-	struct channel *chp = &recvchan;
+	int i, n, irqf;
 
 	/*
 	 * Timer1 is the workhorse. It is set up with a divide-by-64 to free-run
@@ -130,20 +129,18 @@ main()
 			libradio_debug();
 		if (libradio_elapsed_second() && radio.tens_of_minutes > 143)
 			radio.tens_of_minutes = 0;
-		if (irqf) {
-			libradio_get_fifo_info(0);
+		if (irqf & LIBRADIO_WAIT_RXINT) {
 			libradio_get_int_status();
 			libradio_get_modem_status();
 			libradio_irq_enable(1);
 		}
 		/*
-		 * If we have a packet, print it out.
+		 * Pull everything out of the RX FIFO in one go, and print
+		 * out whatever we got.
 		 */
-		while (radio.rx_fifo >= SI4463_PACKET_LEN) {
-			if (libradio_recv(chp, radio.my_channel))
-				display_packet(chp);
-			libradio_get_fifo_info(0);
-		}
+		n = libradio_recv_burst(recvchan, SI4463_FIFO_PACKETS, radio.my_channel);
+		for (i = 0; i < n; i++)
+			display_packet(&recvchan[i]);
 		_watchdog();
 	}
 }
@@ -169,7 +166,7 @@ display_packet(struct channel *chp)
 	len += PACKET_HEADER_LEN;
 	for (i = 0, cp = (uchar_t *)&chp->packet; i < len; i++) {
 		value = *cp++;
-		putchar((i == 6) ? '.' : ' ');
+		putchar((i == PACKET_HEADER_LEN) ? '.' : ' ');
 		hexdigit((value >> 4) & 15);
 		hexdigit(value & 15);
 	}